@@ -0,0 +1,143 @@
+#ifndef INCP_H
+#define INCP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INCP_DEFAULT_PORT "4627"
+
+/* Session flags. */
+#define INCP_NO_LOCAL (1 << 0) /* Always send file data over the connection. */
+
+/**
+ * How much of each received file is written to stable storage before the
+ * client is told it is done. See incp_listen().
+ */
+typedef enum IncpSync {
+    INCP_SYNC_NONE,
+    INCP_SYNC_BATCH,
+    INCP_SYNC_FILE,
+} IncpSync;
+
+/**
+ * A connection to an incp server that any number of transfers can be submitted
+ * to. Transfers run one after the other, in the order they were submitted, on a
+ * background thread and all share one connection.
+ */
+typedef struct IncpSession IncpSession;
+
+/**
+ * Called once for every submitted transfer, from incp_session_poll() or
+ * incp_session_wait() on the thread that called them. status is 0 if every file
+ * was transferred, otherwise -1 and message describes the error.
+ *
+ * A status of 0 means the server has received the files. It does not mean they
+ * are in place yet. A server using INCP_SYNC_BATCH may still hold them under
+ * temporary names until the destination changes, the client has been quiet
+ * for half a second, or the session is closed. incp_session_close() returns 0
+ * only once every file has been committed.
+ */
+typedef void (*IncpCallback)(IncpSession *session, unsigned long id, int status, const char *message, void *userdata);
+
+/**
+ * Must be called once before any other function. On Windows this starts
+ * Winsock.
+ *
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int incp_init(void);
+
+/**
+ * Undoes incp_init().
+ */
+void incp_cleanup(void);
+
+/**
+ * Creates a session with the server at address and port, which may be NULL for
+ * the default port. flags is 0 or INCP_NO_LOCAL. This does not block, the
+ * connection is made when the first transfer runs, retrying for about a minute
+ * until the server is listening. If the connection is lost, the next transfer
+ * tries once to reconnect and fails right away if the server is gone.
+ *
+ * Returns the session or NULL if it could not be created.
+ */
+IncpSession *incp_session_open(const char *address, const char *port, int flags);
+
+/**
+ * Queues a transfer of nsources files to dest on the server, with the same
+ * meaning as the incp command line. The strings are copied. cb may be NULL.
+ *
+ * Returns the id of the transfer, which is also passed to cb, or 0 if it could
+ * not be queued.
+ */
+unsigned long incp_session_submit(IncpSession *session, const char *const *sources, size_t nsources,
+    const char *dest, IncpCallback cb, void *userdata);
+
+/**
+ * Returns a handle that becomes ready when finished transfers are waiting for
+ * incp_session_poll(). On Unix this is a file descriptor that becomes
+ * readable, on Windows it is an event HANDLE that becomes signaled.
+ */
+intptr_t incp_session_pollfd(IncpSession *session);
+
+/**
+ * Runs the callbacks of all finished transfers without blocking.
+ *
+ * Returns the number of callbacks run.
+ */
+size_t incp_session_poll(IncpSession *session);
+
+/**
+ * Blocks until every submitted transfer has finished and runs their callbacks.
+ *
+ * Returns 0 if every transfer in the session so far succeeded or -1 otherwise.
+ */
+int incp_session_wait(IncpSession *session);
+
+/**
+ * Waits for every submitted transfer, ends the session, and frees it. Ending
+ * the session waits for the server to commit every file it received.
+ *
+ * Returns 0 if all transfers succeeded and the server committed them, or -1
+ * otherwise.
+ */
+int incp_session_close(IncpSession *session);
+
+/**
+ * Listens on port for one client and receives its files, then returns. Each
+ * received path is printed to stdout and errors to stderr.
+ *
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int incp_listen(const char *port, IncpSync sync);
+
+/**
+ * Starts recording a timeline of every connection, message, and file I/O in
+ * this process, on all threads. The timeline is written to path in Chrome trace
+ * event format, which chrome://tracing and Perfetto can open, when
+ * incp_trace_stop() is called. While no trace is recording, the cost is one
+ * relaxed atomic load per traced call.
+ *
+ * Returns 0 on success or -1 with errno set if path could not be opened or a
+ * trace is already recording.
+ */
+int incp_trace_start(const char *path);
+
+/**
+ * Stops recording and writes the trace. No transfer may be running, so every
+ * session must be closed first.
+ *
+ * Returns 0 on success or -1 with errno set if no trace was recording or it
+ * could not be written.
+ */
+int incp_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
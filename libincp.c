@@ -0,0 +1,2901 @@
+#if defined(__linux__)
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* For syncfs() and copy_file_range(). */
+#endif
+#define INCP_LOCAL_COPY /* Same host transfers are copied inside the kernel. */
+#endif
+
+#if defined(_WIN32)
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <windows.h>
+
+#include <io.h>
+#include <iphlpapi.h>
+#include <process.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+typedef ptrdiff_t ssize_t;
+
+typedef SOCKET OS_SOCKET;
+#define OS_INVALID_SOCKET INVALID_SOCKET
+
+#define OS_POLL WSAPoll
+#define OS_SHUT_WR SD_SEND
+
+typedef HANDLE OS_THREAD;
+typedef LPTHREAD_START_ROUTINE OS_THREAD_FN;
+#define OS_THREAD_PROC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define OS_THREAD_RESULT 0
+typedef SRWLOCK OS_MUTEX;
+typedef CONDITION_VARIABLE OS_COND;
+
+#define OS_STAT _stat64
+
+#else /* Unix */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int OS_SOCKET;
+#define OS_INVALID_SOCKET (-1)
+
+#define OS_POLL poll
+#define OS_SHUT_WR SHUT_WR
+
+typedef pthread_t OS_THREAD;
+typedef void *(*OS_THREAD_FN)(void *);
+#define OS_THREAD_PROC(name, arg) void *name(void *arg)
+#define OS_THREAD_RESULT NULL
+typedef pthread_mutex_t OS_MUTEX;
+typedef pthread_cond_t OS_COND;
+
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
+
+#if defined(INCP_LOCAL_COPY)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#define OS_STAT stat
+
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "incp.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define OS_THREAD_LOCAL __declspec(thread)
+#else
+#define OS_THREAD_LOCAL _Thread_local
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define OS_MSG_NOSIGNAL MSG_NOSIGNAL
+#else
+#define OS_MSG_NOSIGNAL 0
+#endif
+
+#define BACKLOG 10
+
+#define CONNECT_TIMEOUT_MS 60000 /* About 1 minute. */
+#define CONNECT_ATTEMPT_DELAY_MS 250 /* RFC 8305 connection attempt delay. */
+#define CONNECT_BACKOFF_MIN_MS 5
+#define CONNECT_BACKOFF_MAX_MS 500
+#define CONNECT_MAX_ADDRS 16
+#define CONNECT_RECONNECT_TIMEOUT_MS 2000 /* For the one try after a lost connection. */
+
+#define PREFETCH_DEPTH 8 /* Source files opened ahead of the one being sent. */
+#define PREFETCH_THREADS 4
+#define PREFETCH_READAHEAD (1 << 20) /* Bytes of each file to read ahead. */
+
+#define SYNC_BATCH_FILES 1024 /* Files synced together by the batch policy. */
+#define SYNC_BATCH_IDLE_MS 500 /* A quiet client has its batch synced right away. */
+
+#define TRACE_BLOCK_EVENTS 4096 /* Events in each block of a thread's trace buffer. */
+#define TRACE_DETAIL_MAX 64
+#define TRACE_DETAIL_CUT "..." /* Starts a detail that was too long to keep whole. */
+
+#define BUFFER_SIZE 8192
+
+#define CRLF "\r\n"
+#define INCP_MSG_HELLO "HELLO"
+#define INCP_MSG_OK "OK"
+#define INCP_MSG_LOCAL "LOCAL"
+#define INCP_MSG_DONE "DONE"
+#define INCP_MSG_DEST "DEST"
+#define INCP_MSG_COMMIT "COMMIT"
+#define INCP_MSG_ERROR "ERROR"
+
+#define FILEINFO_IRUSR (1 << 0) /* Read by owner. */
+#define FILEINFO_IWUSR (1 << 1) /* Write by owner. */
+#define FILEINFO_IXUSR (1 << 2) /* Execute by owner. */
+#define FILEINFO_IRGRP (1 << 3) /* Read by group. */
+#define FILEINFO_IWGRP (1 << 4) /* Write by group. */
+#define FILEINFO_IXGRP (1 << 5) /* Execute by group. */
+#define FILEINFO_IROTH (1 << 6) /* Read by others. */
+#define FILEINFO_IWOTH (1 << 7) /* Write by others. */
+#define FILEINFO_IXOTH (1 << 8) /* Execute by others. */
+#define FILEINFO_ISDIR (1 << 9) /* Directory. */
+#define FILEINFO_ISREG (1 << 10) /* Regular file. */
+#define FILEINFO_ISLNK (1 << 11) /* Symbolic link. */
+
+typedef struct FileInfo {
+    int32_t mode;
+    unsigned long long size;
+    char name[1024];
+} FileInfo;
+
+/**
+ * Given a string that has different file properties separated by a space,
+ * return the info as a struct. The file info string is similar in output to 'ls
+ * -l'. The columns are file type/permissions, size (in bytes), and then name.
+ *
+ * Example file info string:
+ *   'drwxr-xr-x 4627 FileName.txt'
+ *
+ * Returns 0 on success or -1 if not given a valid file info string.
+ */
+static int fileinfo_parse(FileInfo *finfo, char *fileinfo)
+{
+    char *str = fileinfo;
+    const char delim = ' ';
+    char *prop_end = strchr(str, delim);
+    if (prop_end == NULL) {
+        return -1;
+    }
+    prop_end[0] = '\0';
+    /* Parse mode. */
+    finfo->mode = 0;
+    size_t prop_len = strlen(str);
+    if (prop_len < 10) {
+        return -1;
+    }
+    if (str[0] != 'd' && str[0] != '-') {
+        return -1;
+    }
+    if (str[0] == 'd') {
+        finfo->mode = FILEINFO_ISDIR;
+    } else {
+        finfo->mode = FILEINFO_ISREG;
+    }
+    if (str[1] == 'r')
+        finfo->mode |= FILEINFO_IRUSR;
+    if (str[2] == 'w')
+        finfo->mode |= FILEINFO_IWUSR;
+    if (str[3] == 'x')
+        finfo->mode |= FILEINFO_IXUSR;
+    if (str[4] == 'r')
+        finfo->mode |= FILEINFO_IRGRP;
+    if (str[5] == 'w')
+        finfo->mode |= FILEINFO_IWGRP;
+    if (str[6] == 'x')
+        finfo->mode |= FILEINFO_IXGRP;
+    if (str[7] == 'r')
+        finfo->mode |= FILEINFO_IROTH;
+    if (str[8] == 'w')
+        finfo->mode |= FILEINFO_IWOTH;
+    if (str[9] == 'x')
+        finfo->mode |= FILEINFO_IXOTH;
+    str = prop_end + 1;
+    prop_end = strchr(str, delim);
+    if (prop_end == NULL) {
+        return -1;
+    }
+    prop_end[0] = '\0';
+    /* Parse size. */
+    errno = 0;
+    finfo->size = strtoull(str, NULL, 10);
+    if (finfo->size == ULLONG_MAX && errno == ERANGE) {
+        return -1;
+    }
+    /* Parse name. */
+    str = prop_end + 1;
+    size_t len = strlen(str);
+    if (len >= (sizeof(finfo->name) - 1)) {
+        return -1;
+    }
+    strcpy(finfo->name, str);
+
+    return 0;
+}
+
+static int fileinfo_snprint(const FileInfo *finfo, char *str, size_t n)
+{
+    char modestr[11];
+    modestr[0] = finfo->mode & FILEINFO_ISDIR ? 'd' : '-';
+    modestr[1] = finfo->mode & FILEINFO_IRUSR ? 'r' : '-';
+    modestr[2] = finfo->mode & FILEINFO_IWUSR ? 'w' : '-';
+    modestr[3] = finfo->mode & FILEINFO_IXUSR ? 'x' : '-';
+    modestr[4] = finfo->mode & FILEINFO_IRGRP ? 'r' : '-';
+    modestr[5] = finfo->mode & FILEINFO_IWGRP ? 'w' : '-';
+    modestr[6] = finfo->mode & FILEINFO_IXGRP ? 'x' : '-';
+    modestr[7] = finfo->mode & FILEINFO_IROTH ? 'r' : '-';
+    modestr[8] = finfo->mode & FILEINFO_IWOTH ? 'w' : '-';
+    modestr[9] = finfo->mode & FILEINFO_IXOTH ? 'x' : '-';
+    modestr[10] = '\0';
+    return snprintf(str, n, "%s %llu %s", modestr, finfo->size, finfo->name);
+}
+
+/**
+ * Copy file permissions from file info to the file at path.
+ *
+ * On success, zero is returned. On error, -1 is returned and errno is set
+ * appropriately.
+ */
+static int fileinfo_cpyperm(const FileInfo *finfo, char *path)
+{
+#if defined(_WIN32)
+    unsigned short perms = 0;
+    if (finfo->mode & FILEINFO_IRUSR)
+        perms |= S_IREAD;
+    if (finfo->mode & FILEINFO_IWUSR)
+        perms |= S_IWRITE;
+    if (finfo->mode & FILEINFO_IXUSR)
+        perms |= S_IEXEC;
+    return _chmod(path, perms);
+#else
+    mode_t perms = 0;
+    if (finfo->mode & FILEINFO_IRUSR)
+        perms |= S_IRUSR;
+    if (finfo->mode & FILEINFO_IWUSR)
+        perms |= S_IWUSR;
+    if (finfo->mode & FILEINFO_IXUSR)
+        perms |= S_IXUSR;
+    if (finfo->mode & FILEINFO_IRGRP)
+        perms |= S_IRGRP;
+    if (finfo->mode & FILEINFO_IWGRP)
+        perms |= S_IWGRP;
+    if (finfo->mode & FILEINFO_IXGRP)
+        perms |= S_IXGRP;
+    if (finfo->mode & FILEINFO_IROTH)
+        perms |= S_IROTH;
+    if (finfo->mode & FILEINFO_IWOTH)
+        perms |= S_IWOTH;
+    if (finfo->mode & FILEINFO_IXOTH)
+        perms |= S_IXOTH;
+    return chmod(path, perms);
+#endif
+}
+
+/**
+ * Copy permissions from a stat structure to file info structure.
+ */
+static void fileinfo_setperm(FileInfo *finfo, const struct OS_STAT *s)
+{
+    finfo->mode = 0;
+    if ((s->st_mode & S_IFMT) == S_IFDIR)
+        finfo->mode |= FILEINFO_ISDIR;
+    if ((s->st_mode & S_IFMT) == S_IFREG)
+        finfo->mode |= FILEINFO_ISREG;
+#if defined(_WIN32)
+    unsigned short perms = s->st_mode & ~S_IFMT;
+    if (perms & S_IREAD)
+        finfo->mode |= FILEINFO_IRUSR;
+    if (perms & S_IWRITE)
+        finfo->mode |= FILEINFO_IWUSR;
+    if (perms & S_IEXEC)
+        finfo->mode |= FILEINFO_IXUSR;
+#else
+    mode_t perms = s->st_mode & ~S_IFMT;
+    if (perms & S_IRUSR)
+        finfo->mode |= FILEINFO_IRUSR;
+    if (perms & S_IWUSR)
+        finfo->mode |= FILEINFO_IWUSR;
+    if (perms & S_IXUSR)
+        finfo->mode |= FILEINFO_IXUSR;
+    if (perms & S_IRGRP)
+        finfo->mode |= FILEINFO_IRGRP;
+    if (perms & S_IWGRP)
+        finfo->mode |= FILEINFO_IWGRP;
+    if (perms & S_IXGRP)
+        finfo->mode |= FILEINFO_IXGRP;
+    if (perms & S_IROTH)
+        finfo->mode |= FILEINFO_IROTH;
+    if (perms & S_IWOTH)
+        finfo->mode |= FILEINFO_IWOTH;
+    if (perms & S_IXOTH)
+        finfo->mode |= FILEINFO_IXOTH;
+#endif
+}
+
+/**
+ * Converts all Windows path separators \ to /.
+ */
+static void normalize_sep(char *path)
+{
+    for (; *path; path++) {
+        if (*path == '\\') {
+            *path = '/';
+        }
+    }
+}
+
+static int os_closesocket(OS_SOCKET s)
+{
+#if defined(_WIN32)
+    return closesocket(s);
+#else
+    return close(s);
+#endif
+}
+
+/**
+ * Returns the error code of the last failed socket call.
+ */
+static int os_socket_errno(void)
+{
+#if defined(_WIN32)
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+/**
+ * Switches a socket between blocking and non-blocking mode.
+ *
+ * Returns 0 on success or -1 if an error occurred.
+ */
+static int os_setnonblocking(OS_SOCKET s, bool nonblocking)
+{
+#if defined(_WIN32)
+    u_long mode = nonblocking ? 1 : 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(s, F_SETFL, flags) == -1 ? -1 : 0;
+#endif
+}
+
+/**
+ * Returns a monotonic timestamp in milliseconds.
+ */
+static long long os_now_ms(void)
+{
+#if defined(_WIN32)
+    return (long long)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/**
+ * Returns a monotonic timestamp in microseconds.
+ */
+static long long os_now_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static int os_getpid(void)
+{
+#if defined(_WIN32)
+    return _getpid();
+#else
+    return (int)getpid();
+#endif
+}
+
+/**
+ * Flushes a file and asks the OS to write it to stable storage.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int os_fsync(FILE *file)
+{
+    if (fflush(file) != 0) {
+        return -1;
+    }
+#if defined(_WIN32)
+    return _commit(_fileno(file));
+#else
+    return fsync(fileno(file));
+#endif
+}
+
+/**
+ * Gets the stat info of an open file.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int os_fstat(FILE *file, struct OS_STAT *s)
+{
+#if defined(_WIN32)
+    return _fstat64(_fileno(file), s);
+#else
+    return fstat(fileno(file), s);
+#endif
+}
+
+/**
+ * Writes the directory at path to stable storage so that renames into it are
+ * durable. This is a no-op on Windows, where renames are written through.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int os_fsync_dir(const char *path)
+{
+#if defined(_WIN32)
+    (void)path;
+    return 0;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int err = fsync(fd);
+    close(fd);
+    return err;
+#endif
+}
+
+/**
+ * Writes everything on the filesystem containing path to stable storage. Where
+ * syncfs() is not available all filesystems are synced.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int os_syncfs(const char *path)
+{
+#if defined(_WIN32)
+    (void)path;
+    return 0;
+#elif defined(__linux__)
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int err = syncfs(fd);
+    close(fd);
+    return err;
+#else
+    (void)path;
+    sync();
+    return 0;
+#endif
+}
+
+/**
+ * Renames oldpath to newpath, replacing newpath if it exists.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int os_rename(const char *oldpath, const char *newpath)
+{
+#if defined(_WIN32)
+    if (!MoveFileExA(oldpath, newpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+#else
+    return rename(oldpath, newpath);
+#endif
+}
+
+/**
+ * Waits up to timeout_ms for a socket to have data or an EOF to read.
+ *
+ * Returns true if it is readable or false if the time ran out or an error
+ * occurred.
+ */
+static bool os_wait_readable(OS_SOCKET s, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return OS_POLL(&pfd, 1, timeout_ms) > 0;
+}
+
+static void os_sleep_ms(long long ms)
+{
+#if defined(_WIN32)
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+#endif
+}
+
+static int os_thread_create(OS_THREAD *thread, OS_THREAD_FN fn, void *arg)
+{
+#if defined(_WIN32)
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *thread == NULL ? -1 : 0;
+#else
+    return pthread_create(thread, NULL, fn, arg) == 0 ? 0 : -1;
+#endif
+}
+
+static void os_thread_join(OS_THREAD thread)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+static void os_mutex_init(OS_MUTEX *mutex)
+{
+#if defined(_WIN32)
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static void os_mutex_destroy(OS_MUTEX *mutex)
+{
+#if defined(_WIN32)
+    (void)mutex;
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+static void os_mutex_lock(OS_MUTEX *mutex)
+{
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+static void os_mutex_unlock(OS_MUTEX *mutex)
+{
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+static void os_cond_init(OS_COND *cond)
+{
+#if defined(_WIN32)
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+static void os_cond_destroy(OS_COND *cond)
+{
+#if defined(_WIN32)
+    (void)cond;
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+static void os_cond_wait(OS_COND *cond, OS_MUTEX *mutex)
+{
+#if defined(_WIN32)
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+static void os_cond_broadcast(OS_COND *cond)
+{
+#if defined(_WIN32)
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/**
+ * A span of time recorded while tracing. name and cat must be string literals,
+ * detail is copied and may be empty, and bytes is -1 if it does not apply.
+ */
+typedef struct TraceEvent {
+    const char *name;
+    const char *cat;
+    long long ts; /* Start in microseconds. */
+    long long dur;
+    long long bytes;
+    char detail[TRACE_DETAIL_MAX];
+} TraceEvent;
+
+/**
+ * A block of events recorded by one thread. Only the owning thread writes to a
+ * block and it publishes each event by storing nevents with release order, so
+ * recording never takes a lock. When a block is full the thread continues in a
+ * new one. Every block is pushed onto trace_blocks when it is created.
+ */
+typedef struct TraceBlock {
+    struct TraceBlock *next;
+    unsigned long tid;
+    const char *thread_name;
+    atomic_size_t nevents;
+    TraceEvent events[TRACE_BLOCK_EVENTS];
+} TraceBlock;
+
+static atomic_bool trace_on;
+static atomic_uint trace_generation; /* Changed by every incp_trace_stop(). */
+static atomic_ulong trace_next_tid;
+static _Atomic(TraceBlock *) trace_blocks;
+static FILE *trace_file;
+static long long trace_epoch;
+
+/* The block this thread records into. It is only valid while
+ * trace_local_generation matches trace_generation. */
+static OS_THREAD_LOCAL TraceBlock *trace_local;
+static OS_THREAD_LOCAL unsigned trace_local_generation;
+static OS_THREAD_LOCAL unsigned long trace_local_tid;
+static OS_THREAD_LOCAL const char *trace_local_name;
+
+/**
+ * Starts a new block for this thread.
+ *
+ * Returns the block or NULL if out of memory.
+ */
+static TraceBlock *trace_block_new(unsigned generation)
+{
+    TraceBlock *block = malloc(sizeof(*block));
+    if (block == NULL) {
+        return NULL;
+    }
+    if (trace_local_tid == 0) {
+        trace_local_tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    }
+    block->tid = trace_local_tid;
+    block->thread_name = trace_local_name;
+    atomic_init(&block->nevents, 0);
+    block->next = atomic_load_explicit(&trace_blocks, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &trace_blocks, &block->next, block, memory_order_release, memory_order_relaxed)) {
+    }
+    trace_local = block;
+    trace_local_generation = generation;
+    return block;
+}
+
+/**
+ * Names the calling thread in traces. name must be a string literal.
+ */
+static void trace_thread_name(const char *name)
+{
+    trace_local_name = name;
+}
+
+/**
+ * Returns the start time of a span, or 0 if tracing is off. The span is
+ * recorded by passing the start time to trace_end().
+ */
+static long long trace_begin(void)
+{
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed)) {
+        return 0;
+    }
+    return os_now_us();
+}
+
+/**
+ * Records a span that started at start and ends now. Does nothing if start is
+ * 0, which is what trace_begin() returns while tracing is off.
+ */
+static void trace_record(long long start, const char *cat, const char *name, const char *detail, long long bytes)
+{
+    if (start == 0 || !atomic_load_explicit(&trace_on, memory_order_relaxed)) {
+        return;
+    }
+    long long end = os_now_us();
+    unsigned generation = atomic_load_explicit(&trace_generation, memory_order_relaxed);
+    TraceBlock *block = trace_local;
+    size_t n = TRACE_BLOCK_EVENTS;
+    if (block != NULL && trace_local_generation == generation) {
+        n = atomic_load_explicit(&block->nevents, memory_order_relaxed);
+    }
+    if (n == TRACE_BLOCK_EVENTS) {
+        if ((block = trace_block_new(generation)) == NULL) {
+            return;
+        }
+        n = 0;
+    }
+    TraceEvent *e = &block->events[n];
+    e->name = name;
+    e->cat = cat;
+    e->ts = start;
+    e->dur = end - start;
+    e->bytes = bytes;
+    size_t len = detail != NULL ? strlen(detail) : 0;
+    size_t prefix = 0;
+    if (len >= sizeof(e->detail)) {
+        /* Keep the end, which holds the file name of a path, and do not cut a
+         * UTF-8 sequence in half. */
+        prefix = strlen(TRACE_DETAIL_CUT);
+        memcpy(e->detail, TRACE_DETAIL_CUT, prefix);
+        detail += len - (sizeof(e->detail) - 1 - prefix);
+        while (((unsigned char)*detail & 0xC0) == 0x80) {
+            detail++;
+        }
+        len = strlen(detail);
+    }
+    if (len > 0) {
+        memcpy(e->detail + prefix, detail, len);
+    }
+    e->detail[prefix + len] = '\0';
+    atomic_store_explicit(&block->nevents, n + 1, memory_order_release);
+}
+
+static void trace_end(long long start, const char *cat, const char *name, const char *detail)
+{
+    trace_record(start, cat, name, detail, -1);
+}
+
+/**
+ * Ends a span for an operation on path that failed with err. The error follows
+ * the path in its detail, so it is kept if the detail is cut.
+ */
+static void trace_end_error(long long start, const char *cat, const char *name, const char *path, int err)
+{
+    if (start == 0) {
+        return;
+    }
+    char detail[1024 + 128];
+    snprintf(detail, sizeof(detail), "%s: %s", path, strerror(err));
+    trace_end(start, cat, name, detail);
+}
+
+static void trace_end_bytes(long long start, const char *cat, const char *name, long long bytes)
+{
+    trace_record(start, cat, name, NULL, bytes);
+}
+
+/**
+ * Writes str to f as a JSON string.
+ */
+static void trace_write_str(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+int incp_trace_start(const char *path)
+{
+    if (trace_file != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    if ((trace_file = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    trace_thread_name("main");
+    trace_epoch = os_now_us();
+    atomic_store(&trace_on, true);
+    return 0;
+}
+
+int incp_trace_stop(void)
+{
+    if (trace_file == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&trace_on, false);
+    atomic_fetch_add(&trace_generation, 1);
+    TraceBlock *block = atomic_exchange(&trace_blocks, NULL);
+    int pid = os_getpid();
+    const char *sep = "";
+    fprintf(trace_file, "{\"traceEvents\":[");
+    while (block != NULL) {
+        if (block->thread_name != NULL) {
+            fprintf(trace_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":",
+                sep, pid, block->tid);
+            trace_write_str(trace_file, block->thread_name);
+            fprintf(trace_file, "}}");
+            sep = ",";
+        }
+        size_t n = atomic_load_explicit(&block->nevents, memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            const TraceEvent *e = &block->events[i];
+            fprintf(trace_file,
+                "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%lu", sep,
+                e->name, e->cat, e->ts - trace_epoch, e->dur, pid, block->tid);
+            if (e->detail[0] != '\0') {
+                fprintf(trace_file, ",\"args\":{\"detail\":");
+                trace_write_str(trace_file, e->detail);
+                fprintf(trace_file, "}");
+            } else if (e->bytes >= 0) {
+                fprintf(trace_file, ",\"args\":{\"bytes\":%lld}", e->bytes);
+            }
+            fprintf(trace_file, "}");
+            sep = ",";
+        }
+        TraceBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    int err = ferror(trace_file) ? -1 : 0;
+    if (fclose(trace_file) != 0) {
+        err = -1;
+    }
+    trace_file = NULL;
+    return err;
+}
+
+/**
+ * Sends all bytes in a buffer.
+ *
+ * Returns the number of bytes sent or -1 if an error occurred.
+ */
+static ssize_t send_all(OS_SOCKET sockfd, const void *buffer, size_t n, int flags)
+{
+    long long tstart = trace_begin();
+    ssize_t nsent = 0;
+    ssize_t sent_total = 0;
+    while ((nsent = send(sockfd, (char *)buffer + sent_total, n - (size_t)sent_total, flags)) > 0) {
+        sent_total += nsent;
+        if ((size_t)sent_total >= n) {
+            break;
+        }
+    }
+    trace_end_bytes(tstart, "net", "send", sent_total);
+    if (nsent < 0) {
+        return nsent;
+    }
+    return sent_total;
+}
+
+/**
+ * Reads from socket until a CRLF is found or until the buffer is full. If a
+ * CRLF is found it is replaced by a terminating null. On success buffer will
+ * always be filled with a valid string.
+ *
+ * Return the length of the string or -1 if an error occurred or if buffer is
+ * filled before finding CRLF.
+ */
+static ssize_t recv_str(OS_SOCKET sockfd, void *buffer, size_t n, int flags)
+{
+    ssize_t nread = 0;
+    size_t read_total = 0;
+    while (1) {
+        long long tstart = trace_begin();
+        nread = recv(sockfd, ((char *)buffer) + read_total, n - read_total, flags);
+        trace_end_bytes(tstart, "net", "recv", nread > 0 ? nread : 0);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            } else {
+                return nread;
+            }
+        }
+        read_total += nread;
+        if (read_total >= n) {
+            return -1;
+        }
+        /* We are assuming a CR is always followed by a LF */
+        char *pos = memchr(buffer, '\r', read_total);
+        if (pos != NULL) {
+            *pos = '\0';
+            read_total = pos - (char *)buffer;
+            break;
+        }
+    }
+    return read_total;
+}
+
+/**
+ * Sends exactly size bytes of srcfile, the size that was sent in its file info,
+ * so a file that changes while it is sent cannot corrupt the stream.
+ *
+ * Returns 0 on success or -1 with errno set. errno is EIO if the file shrank.
+ */
+static int send_file(OS_SOCKET sockfd, void *buffer, size_t n, int flags, FILE *srcfile, unsigned long long size)
+{
+    unsigned long long remaining = size;
+    while (remaining > 0) {
+        long long tstart = trace_begin();
+        size_t nread = fread(buffer, 1, (size_t)MIN((unsigned long long)n, remaining), srcfile);
+        if (nread == 0) {
+            if (!ferror(srcfile)) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        trace_end_bytes(tstart, "disk", "read", (long long)nread);
+        if (send_all(sockfd, buffer, nread, flags) != (ssize_t)nread) {
+            return -1;
+        }
+        remaining -= nread;
+    }
+    return 0;
+}
+
+static int recv_file(OS_SOCKET sockfd, void *buffer, size_t n, int flags, FILE *outfile, size_t fsize)
+{
+    ssize_t nread = 0;
+    size_t read_total = 0;
+    while (read_total < fsize) {
+        long long tstart = trace_begin();
+        nread = recv(sockfd, buffer, MIN(n, fsize - read_total), flags);
+        trace_end_bytes(tstart, "net", "recv", nread > 0 ? nread : 0);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            } else {
+                return -1;
+            }
+        }
+        read_total += nread;
+        tstart = trace_begin();
+        if (fwrite(buffer, nread, 1, outfile) != 1) {
+            return -1;
+        }
+        trace_end_bytes(tstart, "disk", "write", nread);
+    }
+    return 0;
+}
+
+/**
+ * A source file that has been opened and stat'ed ahead of time. If either call
+ * failed, file is NULL, err holds the errno, and errwhere names the call.
+ */
+typedef struct PrefetchSlot {
+    struct OS_STAT statinfo;
+    FILE *file;
+    int err;
+    const char *errwhere;
+    bool ready;
+} PrefetchSlot;
+
+/**
+ * Stats and opens source files on background threads, at most PREFETCH_DEPTH
+ * files ahead of the file currently being sent, so the next file is ready as
+ * soon as the current one is done.
+ */
+typedef struct Prefetcher {
+    char **paths;
+    size_t npaths;
+    size_t next; /* Index of the next path a worker will claim. */
+    size_t consumed; /* Number of files taken by prefetcher_take(). */
+    bool stop;
+    PrefetchSlot slots[PREFETCH_DEPTH];
+    OS_MUTEX mutex;
+    OS_COND cond;
+    OS_THREAD threads[PREFETCH_THREADS];
+    size_t nthreads;
+} Prefetcher;
+
+static void prefetch_one(const char *path, PrefetchSlot *slot)
+{
+    slot->file = NULL;
+    slot->err = 0;
+    slot->errwhere = NULL;
+    long long tstart = trace_begin();
+    slot->file = fopen(path, "rb");
+    if (slot->file == NULL) {
+        slot->err = errno;
+        slot->errwhere = "fopen";
+        trace_end_error(tstart, "disk", "open", path, slot->err);
+        return;
+    }
+    trace_end(tstart, "disk", "open", path);
+    /* The size and mode are taken from the open file, so they describe the
+     * very file that is sent. */
+    tstart = trace_begin();
+    if (os_fstat(slot->file, &slot->statinfo) != 0) {
+        slot->err = errno;
+        slot->errwhere = "stat";
+        fclose(slot->file);
+        slot->file = NULL;
+        trace_end_error(tstart, "disk", "stat", path, slot->err);
+        return;
+    }
+    trace_end(tstart, "disk", "stat", path);
+#if defined(POSIX_FADV_WILLNEED)
+    /* Start reading the first blocks in before they are needed. Errors only
+     * mean there is no readahead, so they are ignored. */
+    posix_fadvise(fileno(slot->file), 0, PREFETCH_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static OS_THREAD_PROC(prefetch_worker, arg)
+{
+    Prefetcher *pf = arg;
+    trace_thread_name("prefetch");
+    os_mutex_lock(&pf->mutex);
+    while (!pf->stop) {
+        if (pf->next >= pf->npaths || pf->next >= pf->consumed + PREFETCH_DEPTH) {
+            os_cond_wait(&pf->cond, &pf->mutex);
+            continue;
+        }
+        size_t i = pf->next++;
+        os_mutex_unlock(&pf->mutex);
+        PrefetchSlot slot;
+        prefetch_one(pf->paths[i], &slot);
+        os_mutex_lock(&pf->mutex);
+        slot.ready = true;
+        pf->slots[i % PREFETCH_DEPTH] = slot;
+        os_cond_broadcast(&pf->cond);
+    }
+    os_mutex_unlock(&pf->mutex);
+    return OS_THREAD_RESULT;
+}
+
+/**
+ * Starts prefetching the given paths. If no threads can be started, files are
+ * opened on demand by prefetcher_take().
+ */
+static void prefetcher_start(Prefetcher *pf, char **paths, size_t npaths)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->paths = paths;
+    pf->npaths = npaths;
+    os_mutex_init(&pf->mutex);
+    os_cond_init(&pf->cond);
+    size_t nthreads = MIN(npaths, PREFETCH_THREADS);
+    for (size_t i = 0; i < nthreads; i++) {
+        if (os_thread_create(&pf->threads[pf->nthreads], prefetch_worker, pf) == 0) {
+            pf->nthreads++;
+        }
+    }
+}
+
+/**
+ * Waits for the next source file in order and moves it into slot. The caller
+ * owns slot->file afterwards.
+ */
+static void prefetcher_take(Prefetcher *pf, PrefetchSlot *slot)
+{
+    if (pf->nthreads == 0) {
+        prefetch_one(pf->paths[pf->consumed++], slot);
+        return;
+    }
+    long long tstart = trace_begin();
+    os_mutex_lock(&pf->mutex);
+    PrefetchSlot *next = &pf->slots[pf->consumed % PREFETCH_DEPTH];
+    while (!next->ready) {
+        os_cond_wait(&pf->cond, &pf->mutex);
+    }
+    trace_end(tstart, "disk", "wait_prefetch", pf->paths[pf->consumed]);
+    *slot = *next;
+    next->ready = false;
+    pf->consumed++;
+    os_cond_broadcast(&pf->cond);
+    os_mutex_unlock(&pf->mutex);
+}
+
+/**
+ * Stops all workers and closes any files that were opened but never taken.
+ */
+static void prefetcher_stop(Prefetcher *pf)
+{
+    os_mutex_lock(&pf->mutex);
+    pf->stop = true;
+    os_cond_broadcast(&pf->cond);
+    os_mutex_unlock(&pf->mutex);
+    for (size_t i = 0; i < pf->nthreads; i++) {
+        os_thread_join(pf->threads[i]);
+    }
+    for (size_t i = 0; i < PREFETCH_DEPTH; i++) {
+        if (pf->slots[i].ready && pf->slots[i].file != NULL) {
+            fclose(pf->slots[i].file);
+        }
+    }
+    os_cond_destroy(&pf->cond);
+    os_mutex_destroy(&pf->mutex);
+}
+
+/**
+ * Orders up to n addresses from ailist so that address families alternate,
+ * starting with the family getaddrinfo preferred. The relative order within
+ * each family is kept.
+ *
+ * Returns the number of addresses written to addrs.
+ */
+static size_t interleave_addrs(const struct addrinfo *ailist, const struct addrinfo **addrs, size_t n)
+{
+    const struct addrinfo *same = ailist;
+    const struct addrinfo *diff = ailist;
+    int family = ailist != NULL ? ailist->ai_family : AF_UNSPEC;
+    bool take_same = true;
+    size_t count = 0;
+    while (count < n) {
+        while (same != NULL && same->ai_family != family) {
+            same = same->ai_next;
+        }
+        while (diff != NULL && diff->ai_family == family) {
+            diff = diff->ai_next;
+        }
+        if (same == NULL && diff == NULL) {
+            break;
+        }
+        if ((take_same && same != NULL) || diff == NULL) {
+            addrs[count++] = same;
+            same = same->ai_next;
+        } else {
+            addrs[count++] = diff;
+            diff = diff->ai_next;
+        }
+        take_same = !take_same;
+    }
+    return count;
+}
+
+/**
+ * Races non-blocking connection attempts across all addresses in ailist, in the
+ * style of Happy Eyeballs (RFC 8305). A new attempt is started every
+ * CONNECT_ATTEMPT_DELAY_MS, or as soon as an earlier attempt fails. The first
+ * attempt to complete wins and the others are closed.
+ *
+ * Returns a connected blocking socket, or OS_INVALID_SOCKET with errno set if
+ * every attempt failed or the deadline passed.
+ */
+static OS_SOCKET connect_race(const struct addrinfo *ailist, long long deadline)
+{
+    const struct addrinfo *addrs[CONNECT_MAX_ADDRS];
+    size_t naddrs = interleave_addrs(ailist, addrs, CONNECT_MAX_ADDRS);
+    struct pollfd pfds[CONNECT_MAX_ADDRS];
+    size_t npending = 0;
+    size_t next = 0;
+    long long next_start = os_now_ms();
+    OS_SOCKET winner = OS_INVALID_SOCKET;
+    int lasterr = ETIMEDOUT;
+
+    while (winner == OS_INVALID_SOCKET) {
+        long long now = os_now_ms();
+        if (now >= deadline) {
+            break;
+        }
+        if (next < naddrs && (npending == 0 || now >= next_start)) {
+            const struct addrinfo *aip = addrs[next++];
+            next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            OS_SOCKET s = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+            if (s == OS_INVALID_SOCKET) {
+                lasterr = os_socket_errno();
+                continue;
+            }
+            if (os_setnonblocking(s, true) != 0) {
+                lasterr = os_socket_errno();
+                os_closesocket(s);
+                continue;
+            }
+            if (connect(s, aip->ai_addr, aip->ai_addrlen) == 0) {
+                winner = s;
+                break;
+            }
+            int connerr = os_socket_errno();
+#if defined(_WIN32)
+            bool inprogress = connerr == WSAEWOULDBLOCK;
+#else
+            bool inprogress = connerr == EINPROGRESS || connerr == EINTR;
+#endif
+            if (!inprogress) {
+                lasterr = connerr;
+                os_closesocket(s);
+                continue;
+            }
+            pfds[npending].fd = s;
+            pfds[npending].events = POLLOUT;
+            pfds[npending].revents = 0;
+            npending++;
+            continue;
+        }
+        if (npending == 0) {
+            /* Every address has failed. */
+            break;
+        }
+
+        long long timeout = deadline - now;
+        if (next < naddrs && next_start - now < timeout) {
+            timeout = next_start - now;
+        }
+        if (OS_POLL(pfds, npending, (int)timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            lasterr = os_socket_errno();
+            break;
+        }
+        for (size_t i = 0; i < npending;) {
+            if (pfds[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int soerr = 0;
+            socklen_t soerr_len = sizeof(soerr);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, (void *)&soerr, &soerr_len) != 0) {
+                soerr = os_socket_errno();
+            }
+            if (soerr == 0 && winner == OS_INVALID_SOCKET) {
+                winner = pfds[i].fd;
+            } else {
+                lasterr = soerr != 0 ? soerr : lasterr;
+                os_closesocket(pfds[i].fd);
+                /* Do not wait out the attempt delay after a failure. */
+                next_start = now;
+            }
+            pfds[i] = pfds[--npending];
+        }
+    }
+
+    for (size_t i = 0; i < npending; i++) {
+        os_closesocket(pfds[i].fd);
+    }
+    if (winner != OS_INVALID_SOCKET && os_setnonblocking(winner, false) != 0) {
+        lasterr = os_socket_errno();
+        os_closesocket(winner);
+        winner = OS_INVALID_SOCKET;
+    }
+    if (winner == OS_INVALID_SOCKET) {
+        errno = lasterr;
+    }
+    return winner;
+}
+
+/**
+ * Returns the next number of a xorshift32 sequence. state must not be 0.
+ */
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * Jittered exponential backoff on connection tries. The backoff starts at a few
+ * milliseconds so a server that starts just after the client is found almost
+ * immediately, and retries stop once CONNECT_TIMEOUT_MS has passed.
+ *
+ * Returns a connected socket or OS_INVALID_SOCKET with errno set.
+ */
+static OS_SOCKET connect_retry(const struct addrinfo *ailist)
+{
+    long long deadline = os_now_ms() + CONNECT_TIMEOUT_MS;
+    long long backoff = CONNECT_BACKOFF_MIN_MS;
+    int err = ETIMEDOUT;
+    /* The jitter has its own generator so the process's rand() is left alone.
+     * The stack address keeps threads that start together apart. */
+    uint32_t jitter = (uint32_t)os_now_us() ^ (uint32_t)(uintptr_t)&jitter;
+    if (jitter == 0) {
+        jitter = 1;
+    }
+    while (1) {
+        long long tstart = trace_begin();
+        OS_SOCKET sockfd = connect_race(ailist, deadline);
+        if (sockfd != OS_INVALID_SOCKET) {
+            trace_end(tstart, "net", "connect_attempt", NULL);
+            return sockfd;
+        }
+        if (errno != ETIMEDOUT) {
+            err = errno;
+        }
+        trace_end(tstart, "net", "connect_attempt", strerror(errno));
+        long long remaining = deadline - os_now_ms();
+        if (remaining <= 0) {
+            errno = err;
+            return OS_INVALID_SOCKET;
+        }
+        long long delay = backoff / 2 + xorshift32(&jitter) % (backoff / 2 + 1);
+        tstart = trace_begin();
+        os_sleep_ms(MIN(delay, remaining));
+        trace_end(tstart, "net", "backoff", NULL);
+        backoff = MIN(backoff * 2, CONNECT_BACKOFF_MAX_MS);
+    }
+}
+
+#if defined(INCP_LOCAL_COPY)
+/**
+ * Identity of a source file, sent by clients that run on the same host as the
+ * server so the server can check that it sees the very same file.
+ */
+typedef struct LocalInfo {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime;
+} LocalInfo;
+
+/**
+ * Writes a token that identifies the running kernel to token. Processes that
+ * get the same token run on the same host.
+ *
+ * Returns 0 on success or -1 if the host cannot be identified.
+ */
+static int host_token(char *token, size_t n)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char *line = fgets(token, (int)n, f);
+    fclose(f);
+    if (line == NULL) {
+        return -1;
+    }
+    token[strcspn(token, " \r\n")] = '\0';
+    return token[0] == '\0' ? -1 : 0;
+}
+
+/**
+ * Returns true if the peer of a connected socket has the same address as this
+ * end of the connection, i.e. it is on the same host.
+ */
+static bool peer_is_local(OS_SOCKET sockfd)
+{
+    struct sockaddr_storage peer, self;
+    socklen_t peer_len = sizeof(peer);
+    socklen_t self_len = sizeof(self);
+    if (getpeername(sockfd, (struct sockaddr *)&peer, &peer_len) != 0
+        || getsockname(sockfd, (struct sockaddr *)&self, &self_len) != 0
+        || peer.ss_family != self.ss_family) {
+        return false;
+    }
+    if (peer.ss_family == AF_INET) {
+        return memcmp(&((struct sockaddr_in *)&peer)->sin_addr, &((struct sockaddr_in *)&self)->sin_addr,
+                   sizeof(struct in_addr))
+            == 0;
+    }
+    if (peer.ss_family == AF_INET6) {
+        return memcmp(&((struct sockaddr_in6 *)&peer)->sin6_addr, &((struct sockaddr_in6 *)&self)->sin6_addr,
+                   sizeof(struct in6_addr))
+            == 0;
+    }
+    return false;
+}
+
+/**
+ * Returns true if hex, as printed in /proc/net/tcp, is the address of len
+ * bytes at addr. The kernel prints each 32 bit word of an address as a host
+ * order number.
+ */
+static bool proc_addr_match(const char *hex, const void *addr, size_t len)
+{
+    if (strlen(hex) != len * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < len / 4; i++) {
+        char word_hex[9];
+        memcpy(word_hex, hex + i * 8, 8);
+        word_hex[8] = '\0';
+        uint32_t word = (uint32_t)strtoul(word_hex, NULL, 16);
+        if (memcmp(&word, (const char *)addr + i * 4, 4) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Turns an IPv4-mapped IPv6 address into an IPv4 address.
+ */
+static void unmap_addr(struct sockaddr_storage *ss)
+{
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    if (ss->ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        return;
+    }
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = sin6->sin6_port;
+    memcpy(&sin.sin_addr, &sin6->sin6_addr.s6_addr[12], sizeof(sin.sin_addr));
+    memcpy(ss, &sin, sizeof(sin));
+}
+
+/**
+ * Returns true if the client of a connection from this host runs as root or as
+ * the same user as this process, so it can read every file this process can.
+ * The user that owns the client's end of the connection is looked up in
+ * /proc/net/tcp or /proc/net/tcp6, which only lists sockets in the same
+ * network namespace.
+ */
+static bool peer_may_pull(OS_SOCKET sockfd)
+{
+    struct sockaddr_storage peer, self;
+    socklen_t peer_len = sizeof(peer);
+    socklen_t self_len = sizeof(self);
+    if (getpeername(sockfd, (struct sockaddr *)&peer, &peer_len) != 0
+        || getsockname(sockfd, (struct sockaddr *)&self, &self_len) != 0) {
+        return false;
+    }
+    unmap_addr(&peer);
+    unmap_addr(&self);
+    const void *peer_addr, *self_addr;
+    size_t addr_len;
+    unsigned peer_port, self_port;
+    if (peer.ss_family == AF_INET && self.ss_family == AF_INET) {
+        peer_addr = &((struct sockaddr_in *)&peer)->sin_addr;
+        self_addr = &((struct sockaddr_in *)&self)->sin_addr;
+        addr_len = sizeof(struct in_addr);
+        peer_port = ntohs(((struct sockaddr_in *)&peer)->sin_port);
+        self_port = ntohs(((struct sockaddr_in *)&self)->sin_port);
+    } else if (peer.ss_family == AF_INET6 && self.ss_family == AF_INET6) {
+        peer_addr = &((struct sockaddr_in6 *)&peer)->sin6_addr;
+        self_addr = &((struct sockaddr_in6 *)&self)->sin6_addr;
+        addr_len = sizeof(struct in6_addr);
+        peer_port = ntohs(((struct sockaddr_in6 *)&peer)->sin6_port);
+        self_port = ntohs(((struct sockaddr_in6 *)&self)->sin6_port);
+    } else {
+        return false;
+    }
+
+    FILE *f = fopen(peer.ss_family == AF_INET ? "/proc/net/tcp" : "/proc/net/tcp6", "r");
+    if (f == NULL) {
+        return false;
+    }
+    bool found = false;
+    unsigned long uid = 0;
+    char line[512];
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        /* sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid ... */
+        char local_hex[33], rem_hex[33];
+        unsigned local_port, rem_port;
+        if (sscanf(line, "%*s %32[0-9A-Fa-f]:%x %32[0-9A-Fa-f]:%x %*x %*x:%*x %*x:%*x %*x %lu", local_hex, &local_port,
+                rem_hex, &rem_port, &uid)
+            != 5) {
+            continue;
+        }
+        /* The client's socket is the one whose local end is our peer. */
+        found = local_port == peer_port && rem_port == self_port && proc_addr_match(local_hex, peer_addr, addr_len)
+            && proc_addr_match(rem_hex, self_addr, addr_len);
+    }
+    fclose(f);
+    return found && (uid == 0 || uid == (unsigned long)geteuid());
+}
+
+/**
+ * Writes path as an absolute path to abspath. Symbolic links are not resolved
+ * so the file keeps the name it was given.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int local_abspath(char *abspath, size_t n, const char *path)
+{
+    if (path[0] == '/') {
+        if (strlen(path) >= n) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(abspath, path);
+        return 0;
+    }
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    if (snprintf(abspath, n, "%s/%s", cwd, path) >= (int)n) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parses the '<dev> <ino> <mtime> ' prefix of a LOCAL message and sets rest to
+ * the file info that follows it.
+ *
+ * Returns 0 on success or -1 if str is not a valid prefix.
+ */
+static int localinfo_parse(LocalInfo *linfo, char *str, char **rest)
+{
+    char *end;
+    errno = 0;
+    linfo->dev = strtoull(str, &end, 10);
+    if (end == str || *end != ' ') {
+        return -1;
+    }
+    str = end + 1;
+    linfo->ino = strtoull(str, &end, 10);
+    if (end == str || *end != ' ') {
+        return -1;
+    }
+    str = end + 1;
+    linfo->mtime = strtoll(str, &end, 10);
+    if (end == str || *end != ' ' || errno == ERANGE) {
+        return -1;
+    }
+    *rest = end + 1;
+    return 0;
+}
+
+/**
+ * Returns true if path is the regular file described by linfo and size.
+ */
+static bool localinfo_match(const LocalInfo *linfo, const char *path, unsigned long long size)
+{
+    struct stat s;
+    return stat(path, &s) == 0 && S_ISREG(s.st_mode) && (unsigned long long)s.st_dev == linfo->dev
+        && (unsigned long long)s.st_ino == linfo->ino && (long long)s.st_mtime == linfo->mtime
+        && (unsigned long long)s.st_size == size;
+}
+
+/**
+ * Copies size bytes of the file at srcpath to the start of outfile inside the
+ * kernel. A reflink is tried first, then copy_file_range().
+ *
+ * Returns 0 on success or -1 with errno set. On error outfile may hold part of
+ * the file.
+ */
+static int local_copy(const char *srcpath, FILE *outfile, unsigned long long size)
+{
+    int infd = open(srcpath, O_RDONLY);
+    if (infd == -1) {
+        return -1;
+    }
+    int outfd = fileno(outfile);
+    int err = 0;
+#if defined(FICLONE)
+    if (ioctl(outfd, FICLONE, infd) == 0) {
+        close(infd);
+        return 0;
+    }
+#endif
+    off_t inoff = 0;
+    off_t outoff = 0;
+    while ((unsigned long long)outoff < size) {
+        ssize_t ncopied = copy_file_range(infd, &inoff, outfd, &outoff, size - outoff, 0);
+        if (ncopied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ncopied <= 0) {
+            if (ncopied == 0) {
+                errno = EIO; /* The source file shrank. */
+            }
+            err = -1;
+            break;
+        }
+    }
+    int errsv = errno;
+    close(infd);
+    errno = errsv;
+    return err;
+}
+#endif
+
+/**
+ * Sends the line of length len in buffer followed by a CRLF in one call, so
+ * the CRLF is not held back as a second small segment.
+ *
+ * Returns 0 on success or -1 if the line does not fit or could not be sent.
+ */
+static int send_line(OS_SOCKET sockfd, char *buffer, size_t n, int len)
+{
+    if (len < 0 || (size_t)len + strlen(CRLF) >= n) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buffer + len, CRLF);
+    len += (int)strlen(CRLF);
+    return send_all(sockfd, buffer, len, OS_MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+typedef struct IncpTransfer {
+    unsigned long id;
+    char **sources;
+    size_t nsources;
+    char *dest;
+    IncpCallback cb;
+    void *userdata;
+    int status;
+    char message[256];
+    struct IncpTransfer *next;
+} IncpTransfer;
+
+struct IncpSession {
+    char *address;
+    char *port;
+    int flags;
+    OS_SOCKET sockfd;
+    bool connected; /* The session has been connected at least once. */
+    bool has_dest; /* A destination has been sent on this connection. */
+    bool local; /* The server is on this host and may copy files itself. */
+    bool final_ok; /* The server replies OK or ERROR once it has committed the files. */
+    bool failed; /* A transfer has failed. */
+    bool closing;
+    unsigned long next_id;
+    size_t nunfinished; /* Submitted transfers that have not finished. */
+    IncpTransfer *queue; /* Transfers waiting to run. */
+    IncpTransfer *queue_tail;
+    IncpTransfer *done; /* Finished transfers waiting for their callbacks. */
+    IncpTransfer *done_tail;
+    int close_status;
+    OS_MUTEX mutex;
+    OS_COND cond;
+    OS_THREAD thread;
+#if defined(_WIN32)
+    HANDLE event;
+#else
+    int pipefd[2];
+#endif
+};
+
+static char *str_dup(const char *str)
+{
+    char *copy = malloc(strlen(str) + 1);
+    if (copy != NULL) {
+        strcpy(copy, str);
+    }
+    return copy;
+}
+
+/**
+ * Records why a transfer failed. If errnum is not 0, its description is added
+ * to the message.
+ *
+ * Always returns -1.
+ */
+static int transfer_fail(IncpTransfer *t, int errnum, const char *what)
+{
+    if (errnum != 0) {
+        snprintf(t->message, sizeof(t->message), "%s: %s", what, strerror(errnum));
+    } else {
+        snprintf(t->message, sizeof(t->message), "%s", what);
+    }
+    t->status = -1;
+    return -1;
+}
+
+static void transfer_free(IncpTransfer *t)
+{
+    if (t == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < t->nsources; i++) {
+        free(t->sources[i]);
+    }
+    free(t->sources);
+    free(t->dest);
+    free(t);
+}
+
+static void session_disconnect(IncpSession *s)
+{
+    if (s->sockfd != OS_INVALID_SOCKET) {
+        os_closesocket(s->sockfd);
+        s->sockfd = OS_INVALID_SOCKET;
+    }
+}
+
+/**
+ * Connects to the server and reads its greeting.
+ *
+ * Returns 0 on success or -1 with the error recorded in t.
+ */
+static int session_connect(IncpSession *s, IncpTransfer *t)
+{
+    struct addrinfo *ailist;
+    struct addrinfo hints;
+    int err = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    long long tstart = trace_begin();
+    err = getaddrinfo(s->address, s->port, &hints, &ailist);
+    trace_end(tstart, "net", "getaddrinfo", s->address);
+    if (err != 0) {
+        snprintf(t->message, sizeof(t->message), "getaddrinfo: %s", gai_strerror(err));
+        t->status = -1;
+        return -1;
+    }
+    tstart = trace_begin();
+    if (s->connected) {
+        /* The connection was lost and the server may be gone for good, so
+         * there is only one try. */
+        s->sockfd = connect_race(ailist, os_now_ms() + CONNECT_RECONNECT_TIMEOUT_MS);
+    } else {
+        s->sockfd = connect_retry(ailist);
+    }
+    freeaddrinfo(ailist);
+    trace_end(tstart, "net", "connect", s->address);
+    if (s->sockfd == OS_INVALID_SOCKET) {
+        return transfer_fail(t, errno, "connect");
+    }
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(s->sockfd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&on, sizeof(on));
+#endif
+    s->connected = true;
+    s->has_dest = false;
+    s->local = false;
+    s->final_ok = false;
+
+    /* Get greeting from server. */
+    char buffer[128];
+    tstart = trace_begin();
+    ssize_t nhello = recv_str(s->sockfd, buffer, sizeof(buffer), 0);
+    trace_end(tstart, "proto", "hello", NULL);
+    if (nhello <= 0
+        || (strcmp(buffer, INCP_MSG_HELLO) != 0 && strncmp(buffer, INCP_MSG_HELLO " ", strlen(INCP_MSG_HELLO " ")) != 0)) {
+        session_disconnect(s);
+        return transfer_fail(t, 0, "unexpected reply from server");
+    }
+    return 0;
+}
+
+/**
+ * Sends the files of a transfer, connecting first if needed. A connection that
+ * is left in an unknown state by an error is closed so the next transfer
+ * reconnects.
+ *
+ * Returns 0 on success or -1 with the error recorded in t.
+ */
+static int session_run(IncpSession *s, IncpTransfer *t)
+{
+    /* Start opening source files while the connection is set up. */
+    Prefetcher prefetch;
+    prefetcher_start(&prefetch, t->sources, t->nsources);
+
+    FILE *srcfile = NULL;
+    FileInfo finfo;
+    memset(&finfo, 0, sizeof(finfo));
+    int send_len = 0;
+    char buffer[BUFFER_SIZE];
+    int err = 0;
+    bool broken = true; /* The connection must be closed on error. */
+
+    if (s->sockfd == OS_INVALID_SOCKET && (err = session_connect(s, t)) != 0) {
+        goto cleanup;
+    }
+
+    /* Send server destination info. The first destination on a connection is
+     * plain file info, later ones are prefixed with DEST. */
+    /* If there are more than 1 source files we expect the destination file to be a directory. */
+    size_t len = strlen(t->dest);
+    if (len >= sizeof(finfo.name) - 1) {
+        err = transfer_fail(t, ENAMETOOLONG, "destination path");
+        broken = false;
+        goto cleanup;
+    }
+    strcpy(finfo.name, t->dest);
+    long long tstart = trace_begin();
+    int prefix_len = s->has_dest ? snprintf(buffer, sizeof(buffer), INCP_MSG_DEST " ") : 0;
+    send_len = prefix_len + fileinfo_snprint(&finfo, buffer + prefix_len, sizeof(buffer) - prefix_len);
+    /* The size of a destination is not used, so the first one asks in its place
+     * for the features the client knows about: a final reply once the files are
+     * committed, and whether the server is on this host. The server lists the
+     * ones it supports after its OK, with a token that identifies the host.
+     * Older servers ignore the size. */
+#if defined(INCP_LOCAL_COPY)
+    char token[64];
+    bool ask_local = !s->has_dest && !(s->flags & INCP_NO_LOCAL) && host_token(token, sizeof(token)) == 0;
+#endif
+    if (!s->has_dest) {
+        const char *features = INCP_MSG_COMMIT;
+#if defined(INCP_LOCAL_COPY)
+        if (ask_local) {
+            features = INCP_MSG_COMMIT "," INCP_MSG_LOCAL;
+        }
+#endif
+        send_len = snprintf(buffer, sizeof(buffer), "---------- %s? %s", features, t->dest);
+    }
+    if (send_len >= (int)sizeof(buffer)) {
+        err = transfer_fail(t, ENAMETOOLONG, "destination path");
+        broken = false;
+        goto cleanup;
+    }
+    if (send_line(s->sockfd, buffer, sizeof(buffer), send_len) != 0) {
+        err = transfer_fail(t, 0, "failed to send file info");
+        goto cleanup;
+    }
+
+    /* Expect OK reply. */
+    if (recv_str(s->sockfd, buffer, sizeof(buffer), 0) <= 0) {
+        err = transfer_fail(t, 0, "server did not reply OK");
+        goto cleanup;
+    }
+    if (!s->has_dest && strncmp(buffer, INCP_MSG_OK " ", strlen(INCP_MSG_OK " ")) == 0) {
+        for (char *f = buffer + strlen(INCP_MSG_OK " "), *next; f != NULL; f = next) {
+            if ((next = strchr(f, ' ')) != NULL) {
+                *next++ = '\0';
+            }
+            if (strcmp(f, INCP_MSG_COMMIT) == 0) {
+                s->final_ok = true;
+            }
+#if defined(INCP_LOCAL_COPY)
+            if (ask_local && strncmp(f, INCP_MSG_LOCAL "=", strlen(INCP_MSG_LOCAL "=")) == 0) {
+                s->local = strcmp(f + strlen(INCP_MSG_LOCAL "="), token) == 0;
+            }
+#endif
+        }
+        buffer[strlen(INCP_MSG_OK)] = '\0';
+    }
+    if (strcmp(buffer, INCP_MSG_OK) != 0) {
+        err = transfer_fail(t, 0, "server did not reply OK");
+        goto cleanup;
+    }
+    trace_end(tstart, "proto", "dest", t->dest);
+    s->has_dest = true;
+
+    for (size_t i = 0; i < t->nsources; i++) {
+        /* Send server source info. */
+        long long file_start = trace_begin();
+        memset(&finfo, 0, sizeof(finfo));
+        PrefetchSlot src;
+        prefetcher_take(&prefetch, &src);
+        srcfile = src.file;
+        if (src.err != 0) {
+            err = transfer_fail(t, src.err, src.errwhere);
+            broken = false;
+            goto cleanup;
+        }
+        fileinfo_setperm(&finfo, &src.statinfo);
+        finfo.size = src.statinfo.st_size;
+        const char *name = t->sources[i];
+        prefix_len = 0;
+#if defined(INCP_LOCAL_COPY)
+        /* A server on the same host reads the file itself. It needs an
+         * absolute path and the identity of the file to be sure it has the
+         * same one. */
+        char abspath[sizeof(finfo.name)];
+        if (s->local && local_abspath(abspath, sizeof(abspath), t->sources[i]) == 0) {
+            name = abspath;
+            prefix_len = snprintf(buffer, sizeof(buffer), INCP_MSG_LOCAL " %llu %llu %lld ",
+                (unsigned long long)src.statinfo.st_dev, (unsigned long long)src.statinfo.st_ino,
+                (long long)src.statinfo.st_mtime);
+        }
+#endif
+        len = strlen(name);
+        if (len >= sizeof(finfo.name) - 1) {
+            err = transfer_fail(t, ENAMETOOLONG, "source path");
+            broken = false;
+            goto cleanup;
+        }
+        strcpy(finfo.name, name);
+        send_len = prefix_len + fileinfo_snprint(&finfo, buffer + prefix_len, sizeof(buffer) - prefix_len);
+        if (send_len >= (int)sizeof(buffer)) {
+            err = transfer_fail(t, ENAMETOOLONG, "source path");
+            broken = false;
+            goto cleanup;
+        }
+        if (send_line(s->sockfd, buffer, sizeof(buffer), send_len) != 0) {
+            err = transfer_fail(t, 0, "failed to send file info");
+            goto cleanup;
+        }
+
+        /* Expect OK reply, or DONE if the server copied the file itself. */
+        tstart = trace_begin();
+        ssize_t nreply = recv_str(s->sockfd, buffer, sizeof(buffer), 0);
+        trace_end(tstart, "proto", "wait_ok", t->sources[i]);
+        if (nreply <= 0) {
+            err = transfer_fail(t, 0, "server did not reply OK");
+            goto cleanup;
+        }
+        if (prefix_len > 0 && strcmp(buffer, INCP_MSG_DONE) == 0) {
+            fclose(srcfile);
+            srcfile = NULL;
+            trace_end(file_start, "proto", "file", t->sources[i]);
+            continue;
+        }
+        if (strcmp(buffer, INCP_MSG_OK) != 0) {
+            err = transfer_fail(t, 0, "server did not reply OK");
+            goto cleanup;
+        }
+
+        /* Send source file to server as bytes. */
+        tstart = trace_begin();
+        if (send_file(s->sockfd, buffer, sizeof(buffer), OS_MSG_NOSIGNAL, srcfile, finfo.size) != 0) {
+            err = transfer_fail(t, errno, "failed to upload file");
+            goto cleanup;
+        }
+        trace_end(tstart, "net", "send_file", t->sources[i]);
+        fclose(srcfile);
+        srcfile = NULL;
+
+        /* Expect OK reply. */
+        tstart = trace_begin();
+        nreply = recv_str(s->sockfd, buffer, sizeof(buffer), 0);
+        trace_end(tstart, "proto", "wait_ok", t->sources[i]);
+        if (nreply <= 0 || strcmp(buffer, INCP_MSG_OK) != 0) {
+            err = transfer_fail(t, 0, "server did not reply OK");
+            goto cleanup;
+        }
+        trace_end(file_start, "proto", "file", t->sources[i]);
+    }
+
+cleanup:
+    if (srcfile != NULL) {
+        fclose(srcfile);
+    }
+    prefetcher_stop(&prefetch);
+    if (err != 0 && broken) {
+        session_disconnect(s);
+    }
+    return err;
+}
+
+/**
+ * Tells the server there are no more files and waits for the final OK, which
+ * is sent once every file has been committed. Servers that did not offer it
+ * close the connection without one, other servers reply ERROR if they could
+ * not commit the files.
+ *
+ * Returns 0 on success or -1 if the server did not commit the files.
+ */
+static int session_finish(IncpSession *s)
+{
+    if (s->sockfd == OS_INVALID_SOCKET) {
+        return 0;
+    }
+    char buffer[128];
+    long long tstart = trace_begin();
+    shutdown(s->sockfd, OS_SHUT_WR);
+    ssize_t nfinal = recv_str(s->sockfd, buffer, sizeof(buffer), 0);
+    trace_end(tstart, "proto", "wait_commit", NULL);
+    session_disconnect(s);
+    if (nfinal > 0) {
+        return strcmp(buffer, INCP_MSG_OK) == 0 ? 0 : -1;
+    }
+    return nfinal == 0 && !s->final_ok ? 0 : -1;
+}
+
+/**
+ * Makes the poll handle ready. Called with the session locked.
+ */
+static void session_notify(IncpSession *s)
+{
+#if defined(_WIN32)
+    SetEvent(s->event);
+#else
+    /* A full pipe is already readable, so a failed write does not matter. */
+    ssize_t nwritten = write(s->pipefd[1], "", 1);
+    (void)nwritten;
+#endif
+}
+
+static OS_THREAD_PROC(session_worker, arg)
+{
+    IncpSession *s = arg;
+    trace_thread_name("session");
+    os_mutex_lock(&s->mutex);
+    while (1) {
+        if (s->queue == NULL) {
+            if (s->closing) {
+                break;
+            }
+            os_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+        IncpTransfer *t = s->queue;
+        s->queue = t->next;
+        if (s->queue == NULL) {
+            s->queue_tail = NULL;
+        }
+        t->next = NULL;
+        os_mutex_unlock(&s->mutex);
+
+        long long tstart = trace_begin();
+        session_run(s, t);
+        trace_end(tstart, "proto", "transfer", t->dest);
+
+        os_mutex_lock(&s->mutex);
+        if (t->status != 0) {
+            s->failed = true;
+        }
+        if (s->done_tail != NULL) {
+            s->done_tail->next = t;
+        } else {
+            s->done = t;
+        }
+        s->done_tail = t;
+        s->nunfinished--;
+        session_notify(s);
+        os_cond_broadcast(&s->cond);
+    }
+    os_mutex_unlock(&s->mutex);
+    s->close_status = session_finish(s);
+    return OS_THREAD_RESULT;
+}
+
+int incp_init(void)
+{
+#if defined(_WIN32)
+    WSADATA wsadata;
+    if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void incp_cleanup(void)
+{
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+IncpSession *incp_session_open(const char *address, const char *port, int flags)
+{
+    IncpSession *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->address = str_dup(address);
+    s->port = str_dup(port == NULL ? INCP_DEFAULT_PORT : port);
+    if (s->address == NULL || s->port == NULL) {
+        goto error;
+    }
+    s->flags = flags;
+    s->sockfd = OS_INVALID_SOCKET;
+    s->next_id = 1;
+#if defined(_WIN32)
+    if ((s->event = CreateEventA(NULL, TRUE, FALSE, NULL)) == NULL) {
+        goto error;
+    }
+#else
+    s->pipefd[0] = s->pipefd[1] = -1;
+    if (pipe(s->pipefd) != 0) {
+        goto error;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(s->pipefd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(s->pipefd[i], F_SETFL, fcntl(s->pipefd[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+#endif
+    os_mutex_init(&s->mutex);
+    os_cond_init(&s->cond);
+    if (os_thread_create(&s->thread, session_worker, s) != 0) {
+        os_cond_destroy(&s->cond);
+        os_mutex_destroy(&s->mutex);
+        goto error;
+    }
+    return s;
+
+error:
+#if defined(_WIN32)
+    if (s->event != NULL) {
+        CloseHandle(s->event);
+    }
+#else
+    if (s->pipefd[0] != -1) {
+        close(s->pipefd[0]);
+        close(s->pipefd[1]);
+    }
+#endif
+    free(s->address);
+    free(s->port);
+    free(s);
+    return NULL;
+}
+
+unsigned long incp_session_submit(IncpSession *session, const char *const *sources, size_t nsources,
+    const char *dest, IncpCallback cb, void *userdata)
+{
+    IncpTransfer *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return 0;
+    }
+    t->sources = calloc(nsources > 0 ? nsources : 1, sizeof(*t->sources));
+    t->dest = str_dup(dest);
+    if (t->sources == NULL || t->dest == NULL) {
+        transfer_free(t);
+        return 0;
+    }
+    for (; t->nsources < nsources; t->nsources++) {
+        if ((t->sources[t->nsources] = str_dup(sources[t->nsources])) == NULL) {
+            transfer_free(t);
+            return 0;
+        }
+    }
+    t->cb = cb;
+    t->userdata = userdata;
+
+    os_mutex_lock(&session->mutex);
+    t->id = session->next_id++;
+    if (session->queue_tail != NULL) {
+        session->queue_tail->next = t;
+    } else {
+        session->queue = t;
+    }
+    session->queue_tail = t;
+    session->nunfinished++;
+    os_cond_broadcast(&session->cond);
+    os_mutex_unlock(&session->mutex);
+    return t->id;
+}
+
+intptr_t incp_session_pollfd(IncpSession *session)
+{
+#if defined(_WIN32)
+    return (intptr_t)session->event;
+#else
+    return session->pipefd[0];
+#endif
+}
+
+size_t incp_session_poll(IncpSession *session)
+{
+    os_mutex_lock(&session->mutex);
+    IncpTransfer *done = session->done;
+    session->done = session->done_tail = NULL;
+#if defined(_WIN32)
+    ResetEvent(session->event);
+#else
+    char drain[64];
+    while (read(session->pipefd[0], drain, sizeof(drain)) > 0) {
+    }
+#endif
+    os_mutex_unlock(&session->mutex);
+
+    size_t ncalled = 0;
+    while (done != NULL) {
+        IncpTransfer *next = done->next;
+        if (done->cb != NULL) {
+            done->cb(session, done->id, done->status, done->status != 0 ? done->message : NULL, done->userdata);
+        }
+        transfer_free(done);
+        done = next;
+        ncalled++;
+    }
+    return ncalled;
+}
+
+int incp_session_wait(IncpSession *session)
+{
+    os_mutex_lock(&session->mutex);
+    while (session->nunfinished > 0) {
+        os_cond_wait(&session->cond, &session->mutex);
+    }
+    os_mutex_unlock(&session->mutex);
+    incp_session_poll(session);
+    return session->failed ? -1 : 0;
+}
+
+int incp_session_close(IncpSession *session)
+{
+    os_mutex_lock(&session->mutex);
+    session->closing = true;
+    os_cond_broadcast(&session->cond);
+    os_mutex_unlock(&session->mutex);
+    os_thread_join(session->thread);
+    incp_session_poll(session);
+    int err = session->failed || session->close_status != 0 ? -1 : 0;
+
+    os_cond_destroy(&session->cond);
+    os_mutex_destroy(&session->mutex);
+#if defined(_WIN32)
+    CloseHandle(session->event);
+#else
+    close(session->pipefd[0]);
+    close(session->pipefd[1]);
+#endif
+    free(session->address);
+    free(session->port);
+    free(session);
+    return err;
+}
+
+/**
+ * Copies the directory part of path into dir, or "." if path has none.
+ */
+static void dirname_cpy(char *dir, size_t n, const char *path)
+{
+    const char *sep = strrchr(path, '/');
+    if (sep == NULL) {
+        snprintf(dir, n, ".");
+    } else if (sep == path) {
+        snprintf(dir, n, "/");
+    } else {
+        snprintf(dir, n, "%.*s", (int)(sep - path), path);
+    }
+}
+
+/**
+ * Writes a received file to a temporary name next to its destination and later
+ * renames it into place, so readers never see a partially written file. How
+ * much is synced to disk before a rename depends on the sync policy:
+ *
+ *   INCP_SYNC_NONE  - Nothing is synced.
+ *   INCP_SYNC_BATCH - Renames are queued. Up to SYNC_BATCH_FILES files are
+ *                     synced with one syncfs() and then renamed, and the
+ *                     directories are synced with another syncfs(). The
+ *                     queue is also flushed when the destination changes or
+ *                     the client is quiet for SYNC_BATCH_IDLE_MS.
+ *   INCP_SYNC_FILE  - Every file and its directory are fsync'ed.
+ */
+typedef struct PendingRename {
+    char *tmppath;
+    char *path;
+} PendingRename;
+
+typedef struct CommitQueue {
+    IncpSync policy;
+    unsigned long ntmp; /* Number of temporary names handed out. */
+    PendingRename pending[SYNC_BATCH_FILES];
+    size_t npending;
+} CommitQueue;
+
+/**
+ * Opens a temporary file to receive the file that will be committed to path.
+ * The temporary name is written to tmppath. It is short and hidden in the
+ * directory of path, so it fits wherever the name of path fits.
+ *
+ * Returns the opened file or NULL with errno set.
+ */
+static FILE *commit_open(CommitQueue *q, const char *path, char *tmppath, size_t n)
+{
+    char dir[1024];
+    dirname_cpy(dir, sizeof(dir), path);
+    const char *sep = dir[strlen(dir) - 1] == '/' ? "" : "/";
+    if (snprintf(tmppath, n, "%s%s.incp-%d-%lu", dir, sep, os_getpid(), q->ntmp++) >= (int)n) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return fopen(tmppath, "wbx");
+}
+
+/**
+ * Syncs, renames, and syncs again every queued file.
+ *
+ * Returns 0 on success or -1 with errno set from the first failure. The queue
+ * is empty afterwards either way. If the data could not be synced nothing is
+ * renamed, otherwise every file is renamed that can be, and only the temporary
+ * files that could not be renamed are removed.
+ */
+static int commit_flush(CommitQueue *q)
+{
+    if (q->npending == 0) {
+        return 0;
+    }
+    long long tstart = trace_begin();
+    int err = 0;
+    int errsv = 0;
+    char dir[1024];
+    char prevdir[1024] = "";
+    for (size_t i = 0; i < q->npending && err == 0; i++) {
+        dirname_cpy(dir, sizeof(dir), q->pending[i].path);
+        if (strcmp(dir, prevdir) != 0) {
+            err = os_syncfs(dir);
+            errsv = errno;
+            strcpy(prevdir, dir);
+        }
+    }
+    bool synced = err == 0;
+    prevdir[0] = '\0';
+    for (size_t i = 0; i < q->npending; i++) {
+        if (synced && os_rename(q->pending[i].tmppath, q->pending[i].path) == 0) {
+            dirname_cpy(dir, sizeof(dir), q->pending[i].path);
+            if (strcmp(dir, prevdir) != 0) {
+                if (os_syncfs(dir) != 0 && err == 0) {
+                    err = -1;
+                    errsv = errno;
+                }
+                strcpy(prevdir, dir);
+            }
+        } else {
+            if (err == 0) {
+                err = -1;
+                errsv = errno;
+            }
+            remove(q->pending[i].tmppath);
+        }
+        free(q->pending[i].tmppath);
+        free(q->pending[i].path);
+    }
+    q->npending = 0;
+    trace_end(tstart, "disk", "commit_flush", NULL);
+    errno = errsv;
+    return err;
+}
+
+/**
+ * Commits a fully written and closed temporary file to path according to the
+ * queue's sync policy.
+ *
+ * Returns 0 on success or -1 with errno set.
+ */
+static int commit_add(CommitQueue *q, const char *tmppath, const char *path)
+{
+    if (q->policy != INCP_SYNC_BATCH) {
+        if (os_rename(tmppath, path) != 0) {
+            int errsv = errno;
+            remove(tmppath);
+            errno = errsv;
+            return -1;
+        }
+        if (q->policy == INCP_SYNC_FILE) {
+            char dir[1024];
+            dirname_cpy(dir, sizeof(dir), path);
+            return os_fsync_dir(dir);
+        }
+        return 0;
+    }
+    char *tmpcpy = malloc(strlen(tmppath) + 1);
+    char *pathcpy = malloc(strlen(path) + 1);
+    if (tmpcpy == NULL || pathcpy == NULL) {
+        free(tmpcpy);
+        free(pathcpy);
+        remove(tmppath);
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(tmpcpy, tmppath);
+    strcpy(pathcpy, path);
+    q->pending[q->npending].tmppath = tmpcpy;
+    q->pending[q->npending].path = pathcpy;
+    q->npending++;
+    if (q->npending == SYNC_BATCH_FILES) {
+        return commit_flush(q);
+    }
+    return 0;
+}
+
+#if defined(__linux__)
+/**
+ * Returns true if the file at path has extended attributes that would be lost
+ * by replacing it, or if that cannot be told. Security labels are given to
+ * every new file by the system, so they are not counted, and file systems that
+ * do not support extended attributes have none.
+ */
+static bool has_xattrs(const char *path)
+{
+    static const char *labels[] = { "security.selinux", "security.SMACK64", "security.apparmor" };
+    char names[4096];
+    ssize_t len = listxattr(path, names, sizeof(names));
+    if (len < 0) {
+        return errno != ENOTSUP && errno != ENOSYS;
+    }
+    for (ssize_t i = 0; i < len; i += strlen(names + i) + 1) {
+        bool label = false;
+        for (size_t j = 0; j < sizeof(labels) / sizeof(labels[0]) && !label; j++) {
+            label = strcmp(names + i, labels[j]) == 0;
+        }
+        if (!label) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/**
+ * Returns true if the file at path should be replaced by renaming a temporary
+ * file over it. Only missing files and writable regular files that nothing
+ * would be lost from are. Anything else is written in place so devices, links,
+ * extended attributes, and permission errors behave as they would without a
+ * temporary file.
+ */
+static bool commit_can_rename(const char *path, const struct OS_STAT *s, bool exists)
+{
+    if (!exists) {
+        return true;
+    }
+    if ((s->st_mode & S_IFMT) != S_IFREG) {
+        return false;
+    }
+#if defined(_WIN32)
+    return _access(path, 2) == 0;
+#else
+    struct stat ls;
+    if (lstat(path, &ls) != 0 || S_ISLNK(ls.st_mode) || ls.st_nlink != 1) {
+        return false;
+    }
+#if defined(__linux__)
+    /* ACLs are extended attributes too. */
+    if (has_xattrs(path)) {
+        return false;
+    }
+#endif
+    return access(path, W_OK) == 0;
+#endif
+}
+
+/**
+ * Gives the temporary file that replaces a file with stat info s the same
+ * owner and group.
+ *
+ * Returns 0 on success or -1 if they cannot be kept.
+ */
+static int commit_keep_owner(FILE *tmpfile, const struct OS_STAT *s)
+{
+#if defined(_WIN32)
+    (void)tmpfile;
+    (void)s;
+    return 0;
+#else
+    struct stat ts;
+    if (fstat(fileno(tmpfile), &ts) != 0) {
+        return -1;
+    }
+    if (ts.st_uid == s->st_uid && ts.st_gid == s->st_gid) {
+        return 0;
+    }
+    return fchown(fileno(tmpfile), s->st_uid, s->st_gid);
+#endif
+}
+
+/**
+ * Parses destination file info sent by a client and replaces its mode with the
+ * mode of the destination if it exists.
+ *
+ * Returns 0 on success or -1 if not given a valid file info string.
+ */
+static int dest_parse(FileInfo *destfinfo, char *str)
+{
+    if (fileinfo_parse(destfinfo, str) != 0) {
+        return -1;
+    }
+    normalize_sep(destfinfo->name);
+    struct OS_STAT s;
+    if (OS_STAT(destfinfo->name, &s) == 0) {
+        /* File exists. */
+        fileinfo_setperm(destfinfo, &s);
+    } else {
+        /* File does not exist. */
+        destfinfo->mode = FILEINFO_ISREG;
+    }
+    return 0;
+}
+
+#define DEST_ASKS_COMMIT 0x1
+#define DEST_ASKS_LOCAL 0x2
+
+/**
+ * Returns the features a client asks for in the first destination file info
+ * in str, by listing them in place of its size, e.g. COMMIT,LOCAL?.
+ */
+static int dest_features(const char *str)
+{
+    const char *size = strchr(str, ' ');
+    const char *end = size != NULL ? strchr(size + 1, ' ') : NULL;
+    if (end == NULL || end[-1] != '?') {
+        return 0;
+    }
+    int features = 0;
+    for (const char *f = size + 1, *next; f < end - 1; f = next + 1) {
+        if ((next = memchr(f, ',', end - 1 - f)) == NULL) {
+            next = end - 1;
+        }
+        size_t len = next - f;
+        if (len == strlen(INCP_MSG_COMMIT) && strncmp(f, INCP_MSG_COMMIT, len) == 0) {
+            features |= DEST_ASKS_COMMIT;
+        } else if (len == strlen(INCP_MSG_LOCAL) && strncmp(f, INCP_MSG_LOCAL, len) == 0) {
+            features |= DEST_ASKS_LOCAL;
+        }
+    }
+    return features;
+}
+
+/**
+ * Creates a socket that is bound to and listening on the given address. IPv6
+ * sockets also accept IPv4 connections where the OS allows it.
+ *
+ * Returns the socket or OS_INVALID_SOCKET if an error occurred.
+ */
+static OS_SOCKET listen_addr(const struct addrinfo *aip)
+{
+    OS_SOCKET sockfd = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+    if (sockfd == OS_INVALID_SOCKET) {
+        return OS_INVALID_SOCKET;
+    }
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on)) != 0) {
+        os_closesocket(sockfd);
+        return OS_INVALID_SOCKET;
+    }
+    if (aip->ai_family == AF_INET6) {
+        /* Best effort, an IPv6 only socket is still useful. */
+        int off = 0;
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&off, sizeof(off));
+    }
+    if (bind(sockfd, aip->ai_addr, aip->ai_addrlen) != 0) {
+        os_closesocket(sockfd);
+        return OS_INVALID_SOCKET;
+    }
+    if (listen(sockfd, BACKLOG) != 0) {
+        os_closesocket(sockfd);
+        return OS_INVALID_SOCKET;
+    }
+    return sockfd;
+}
+
+int incp_listen(const char *port, IncpSync sync)
+{
+    struct addrinfo *ailist;
+    struct addrinfo *aip;
+    struct addrinfo hints;
+    OS_SOCKET sockfd = OS_INVALID_SOCKET;
+    int err = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((err = getaddrinfo(NULL, port, &hints, &ailist)) != 0) {
+        fprintf(stderr, "Error: getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    /* Prefer a dual-stack IPv6 socket so both IPv4 and IPv6 clients can
+     * connect, then fall back to any address that works. */
+    for (int pass = 0; pass < 2 && sockfd == OS_INVALID_SOCKET; pass++) {
+        for (aip = ailist; aip != NULL; aip = aip->ai_next) {
+            if (pass == 0 && aip->ai_family != AF_INET6) {
+                continue;
+            }
+            if ((sockfd = listen_addr(aip)) != OS_INVALID_SOCKET) {
+                break;
+            }
+        }
+    }
+
+    freeaddrinfo(ailist);
+
+    if (sockfd == OS_INVALID_SOCKET) {
+        perror("Error: failed to start server");
+        return -1;
+    }
+
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size = sizeof(client_addr);
+    long long tstart = trace_begin();
+    OS_SOCKET clientfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_size);
+    trace_end(tstart, "net", "accept", NULL);
+    if (clientfd == OS_INVALID_SOCKET) {
+        perror("Error: accept");
+        os_closesocket(sockfd);
+        return -1;
+    }
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(clientfd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&on, sizeof(on));
+#endif
+
+    FILE *outfile = NULL;
+    char tmppath[1024 + 64];
+    tmppath[0] = '\0';
+    CommitQueue commitq;
+    memset(&commitq, 0, sizeof(commitq));
+    commitq.policy = sync;
+    int commit_errno = 0;
+    bool final_ok = false;
+    FileInfo destfinfo;
+    memset(&destfinfo, 0, sizeof(destfinfo));
+    FileInfo srcfinfo;
+    memset(&srcfinfo, 0, sizeof(srcfinfo));
+    char buffer[BUFFER_SIZE];
+    ssize_t read;
+
+    /* Send hello */
+    tstart = trace_begin();
+    const char *hello = INCP_MSG_HELLO CRLF;
+    if ((err = send_all(clientfd, hello, strlen(hello), OS_MSG_NOSIGNAL)) == -1) {
+        perror("Error: send");
+        goto cleanup;
+    }
+    trace_end(tstart, "proto", "hello", NULL);
+
+    /* Get destination file info from client. */
+    tstart = trace_begin();
+    read = recv_str(clientfd, buffer, sizeof(buffer), 0);
+    if (read <= 0) {
+        fprintf(stderr, "Error: failed to get data from client\n");
+        goto cleanup;
+    }
+    /* Clients that ask for it get a final OK, or ERROR, once their files are
+     * committed. Clients on the same host that ask for it get a token that
+     * identifies the host, so they can ask for files to be copied locally.
+     * Only clients that can read every file the server can get it, so no
+     * client can have a file copied that it could not read itself. */
+    int features = dest_features(buffer);
+    final_ok = features & DEST_ASKS_COMMIT;
+    char dest_reply[128];
+    snprintf(dest_reply, sizeof(dest_reply), INCP_MSG_OK "%s", final_ok ? " " INCP_MSG_COMMIT : "");
+#if defined(INCP_LOCAL_COPY)
+    char token[64];
+    bool local = (features & DEST_ASKS_LOCAL) && peer_is_local(clientfd) && peer_may_pull(clientfd)
+        && host_token(token, sizeof(token)) == 0;
+    if (local) {
+        size_t len = strlen(dest_reply);
+        snprintf(dest_reply + len, sizeof(dest_reply) - len, " " INCP_MSG_LOCAL "=%s", token);
+    }
+#endif
+    strcat(dest_reply, CRLF);
+    if ((err = dest_parse(&destfinfo, buffer)) != 0) {
+        fprintf(stderr, "Error: bad file info\n");
+        goto cleanup;
+    }
+    struct OS_STAT s;
+
+    /* Send OK */
+    if ((err = send_all(clientfd, dest_reply, strlen(dest_reply), OS_MSG_NOSIGNAL)) == -1) {
+        perror("Error: send");
+        goto cleanup;
+    }
+    trace_end(tstart, "proto", "dest", destfinfo.name);
+
+    while (1) {
+        /* Files waiting for a batch sync are committed as soon as the client
+         * goes quiet, so they do not stay under temporary names while a
+         * long-lived session is idle. */
+        if (commitq.npending > 0 && !os_wait_readable(clientfd, SYNC_BATCH_IDLE_MS)
+            && (err = commit_flush(&commitq)) != 0) {
+            commit_errno = errno;
+            perror("Error: sync");
+            goto cleanup;
+        }
+
+        /* Get source file info from client. */
+        tstart = trace_begin();
+        read = recv_str(clientfd, buffer, sizeof(buffer), 0);
+        trace_end(tstart, "proto", "wait_info", NULL);
+        if (read == 0) {
+            /* No more files to process. Commit any queued files before the
+             * final OK tells the client that everything is in place. Older
+             * clients do not wait for it, so a failed send is not an error.
+             * If the files cannot be committed the client is sent ERROR
+             * instead. */
+            if ((err = commit_flush(&commitq)) != 0) {
+                commit_errno = errno;
+                perror("Error: sync");
+                goto cleanup;
+            }
+            send_all(clientfd, INCP_MSG_OK CRLF, strlen(INCP_MSG_OK CRLF), OS_MSG_NOSIGNAL);
+            err = 0;
+            goto cleanup;
+        } else if (read < 0) {
+            fprintf(stderr, "Error: failed to get data from client\n");
+            goto cleanup;
+        }
+        if (strncmp(buffer, INCP_MSG_DEST " ", strlen(INCP_MSG_DEST " ")) == 0) {
+            /* The files that follow go to a new destination. The files sent
+             * to the previous one are committed first. */
+            tstart = trace_begin();
+            if ((err = dest_parse(&destfinfo, buffer + strlen(INCP_MSG_DEST " "))) != 0) {
+                fprintf(stderr, "Error: bad file info\n");
+                goto cleanup;
+            }
+            if ((err = commit_flush(&commitq)) != 0) {
+                commit_errno = errno;
+                perror("Error: sync");
+                goto cleanup;
+            }
+            if ((err = send_all(clientfd, INCP_MSG_OK CRLF, strlen(INCP_MSG_OK CRLF), OS_MSG_NOSIGNAL)) == -1) {
+                perror("Error: send");
+                goto cleanup;
+            }
+            trace_end(tstart, "proto", "dest", destfinfo.name);
+            continue;
+        }
+        char *info = buffer;
+#if defined(INCP_LOCAL_COPY)
+        /* Clients on the same host prefix the file info with the identity of
+         * the file, asking for it to be copied locally. */
+        LocalInfo linfo;
+        memset(&linfo, 0, sizeof(linfo));
+        bool pull = false;
+        if (local && strncmp(buffer, INCP_MSG_LOCAL " ", strlen(INCP_MSG_LOCAL " ")) == 0) {
+            if (localinfo_parse(&linfo, buffer + strlen(INCP_MSG_LOCAL " "), &info) != 0) {
+                fprintf(stderr, "Error: bad file info\n");
+                err = -1;
+                goto cleanup;
+            }
+            pull = true;
+        }
+#endif
+        if ((err = fileinfo_parse(&srcfinfo, info)) != 0) {
+            fprintf(stderr, "Error: bad file info\n");
+            goto cleanup;
+        }
+#if defined(INCP_LOCAL_COPY)
+        char srcpath[sizeof(srcfinfo.name)];
+        strcpy(srcpath, srcfinfo.name);
+#endif
+        normalize_sep(srcfinfo.name);
+
+        /* Copy file to destination. */
+        char path[1024];
+        if (destfinfo.mode & FILEINFO_ISDIR) {
+            char *name = strrchr(srcfinfo.name, '/'); /* Only get the file name. */
+            if (name != NULL) {
+                name++; /* Do not start the name with '/'. */
+            } else {
+                name = srcfinfo.name;
+            }
+            size_t len = strlen(destfinfo.name);
+            bool has_sep = len > 0 && destfinfo.name[len - 1] == '/';
+            if (snprintf(path, sizeof(path), "%s%s%s", destfinfo.name, has_sep ? "" : "/", name) >= (int)sizeof(path)) {
+                errno = ENAMETOOLONG;
+                perror("Error");
+                err = -1;
+                goto cleanup;
+            }
+        } else {
+            /* This should always be false. In case path and FileInfo.name have
+             * different buffer sizes. */
+            if (strlen(destfinfo.name) >= sizeof(path) - 1) {
+                errno = ENAMETOOLONG;
+                perror("Error");
+                err = -1;
+                goto cleanup;
+            }
+            strcpy(path, destfinfo.name);
+        }
+        printf("%s\n", path);
+        long long file_start = trace_begin();
+        tstart = trace_begin();
+        FileInfo info_tocopy;
+        memset(&info_tocopy, 0, sizeof(info_tocopy));
+        bool exists = OS_STAT(path, &s) == 0;
+        if (exists) {
+            fileinfo_setperm(&info_tocopy, &s);
+        } else {
+            info_tocopy = srcfinfo;
+        }
+        bool in_place = !commit_can_rename(path, &s, exists);
+        if (!in_place) {
+            outfile = commit_open(&commitq, path, tmppath, sizeof(tmppath));
+            if (outfile != NULL && exists && commit_keep_owner(outfile, &s) != 0) {
+                /* Replacing the file would change its owner. */
+                fclose(outfile);
+                remove(tmppath);
+                outfile = NULL;
+                in_place = true;
+            }
+        }
+        if (in_place) {
+            tmppath[0] = '\0';
+            outfile = fopen(path, "wb");
+        }
+        if (outfile == NULL) {
+            perror("Error: fopen");
+            tmppath[0] = '\0';
+            err = -1;
+            goto cleanup;
+        }
+        trace_end(tstart, "disk", "open", path);
+        bool pulled = false;
+#if defined(INCP_LOCAL_COPY)
+        /* If the local copy fails, the file is sent over the connection. */
+        if (pull && localinfo_match(&linfo, srcpath, srcfinfo.size)) {
+            tstart = trace_begin();
+            pulled = local_copy(srcpath, outfile, srcfinfo.size) == 0;
+            trace_end(tstart, "disk", "local_copy", path);
+            if (!pulled && (err = ftruncate(fileno(outfile), 0)) != 0) {
+                perror("Error");
+                goto cleanup;
+            }
+        }
+#endif
+
+        /* Send OK, unless the file has already been copied. Then DONE is sent
+         * in place of the final OK once it is in place. */
+        if (!pulled && (err = send_all(clientfd, INCP_MSG_OK CRLF, strlen(INCP_MSG_OK CRLF), OS_MSG_NOSIGNAL)) == -1) {
+            perror("Error: send");
+            goto cleanup;
+        }
+        // if ((err = recv_file(clientfd, buffer, sizeof(buffer), MSG_NOSIGNAL, outfile, srcfinfo.size)) != 0) {
+        tstart = trace_begin();
+        if (!pulled && (err = recv_file(clientfd, buffer, sizeof(buffer), 0, outfile, srcfinfo.size)) != 0) {
+            fprintf(stderr, "Error: an error occurred while trying to download file\n");
+            goto cleanup;
+        }
+        if (!pulled) {
+            trace_end(tstart, "net", "recv_file", path);
+        }
+#if defined(_WIN32)
+        /* There is no syncfs() on Windows, so batches are synced file by file. */
+        bool sync_file = sync != INCP_SYNC_NONE;
+#else
+        bool sync_file = sync == INCP_SYNC_FILE;
+#endif
+        tstart = trace_begin();
+        if (sync_file && (err = os_fsync(outfile)) != 0) {
+            perror("Error: fsync");
+            goto cleanup;
+        }
+        if (sync_file) {
+            trace_end(tstart, "disk", "fsync", path);
+        }
+        fclose(outfile);
+        outfile = NULL;
+        tstart = trace_begin();
+        if ((err = fileinfo_cpyperm(&info_tocopy, tmppath[0] != '\0' ? tmppath : path)) != 0) {
+            perror("Error");
+            goto cleanup;
+        }
+        trace_end(tstart, "disk", "cpyperm", path);
+        if (tmppath[0] != '\0') {
+            tstart = trace_begin();
+            err = commit_add(&commitq, tmppath, path);
+            tmppath[0] = '\0';
+            if (err != 0) {
+                perror("Error: rename");
+                goto cleanup;
+            }
+            trace_end(tstart, "disk", "commit", path);
+        }
+
+        /* Send OK, or DONE for a file that was copied locally. */
+        const char *reply = pulled ? INCP_MSG_DONE CRLF : INCP_MSG_OK CRLF;
+        if ((err = send_all(clientfd, reply, strlen(reply), OS_MSG_NOSIGNAL)) == -1) {
+            perror("Error: send");
+            goto cleanup;
+        }
+        trace_end(file_start, "proto", "file", path);
+    }
+
+cleanup:
+    if (outfile != NULL) {
+        fclose(outfile);
+    }
+    if (tmppath[0] != '\0') {
+        remove(tmppath);
+    }
+    /* Files that were received in full are still committed. */
+    if (commit_flush(&commitq) != 0 && commit_errno == 0) {
+        commit_errno = errno;
+    }
+    if (err != 0 && final_ok) {
+        char errline[128];
+        int len = snprintf(errline, sizeof(errline), INCP_MSG_ERROR " %s" CRLF,
+            commit_errno != 0 ? strerror(commit_errno) : "transfer failed");
+        if (len > 0 && len < (int)sizeof(errline)) {
+            send_all(clientfd, errline, len, OS_MSG_NOSIGNAL);
+        }
+    }
+    os_closesocket(clientfd);
+    os_closesocket(sockfd);
+    return err;
+}
+
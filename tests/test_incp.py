@@ -1,8 +1,16 @@
 from pathlib import Path
 import asyncio
+import ctypes
+import errno
+import json
 import os
+import select
+import shutil
+import socket
 import stat
+import sys
 import tempfile
+import time
 import unittest
 
 class TestIncp(unittest.IsolatedAsyncioTestCase):
@@ -269,6 +277,635 @@ class TestIncp(unittest.IsolatedAsyncioTestCase):
 
         dir.cleanup()
 
+    async def test_incp_sender_starts_before_receiver(self):
+        '''
+        It should connect shortly after the receiver starts listening when the
+        sender was started first.
+        '''
+        expected_text = b'hello, world\n'
+        dir = tempfile.TemporaryDirectory()
+        expected = Path.joinpath(Path(dir.name), 'expected.txt')
+        actual = Path.joinpath(Path(dir.name), 'actual.txt')
+        f = open(expected.absolute(), 'wb')
+        f.write(expected_text)
+        f.close()
+
+        sender = await asyncio.create_subprocess_exec('./incp', expected.absolute(), f"127.0.0.1:4629:{actual.absolute()}")
+        await asyncio.sleep(0.1)
+        start = time.monotonic()
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4629')
+        await receiver.wait()
+        await sender.wait()
+        elapsed = time.monotonic() - start
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual(0, sender.returncode)
+        self.assertLess(elapsed, 0.5)
+        f = open(actual.absolute(), 'rb')
+        actual_text = f.read()
+        f.close()
+        self.assertEqual(expected_text, actual_text)
+
+        dir.cleanup()
+
+    async def test_incp_ipv6_destination(self):
+        '''
+        It should transfer a file when the destination address is a bracketed
+        IPv6 address.
+        '''
+        if not socket.has_ipv6:
+            self.skipTest('IPv6 is not available')
+        expected_text = b'hello, world\n'
+        dir = tempfile.TemporaryDirectory()
+        expected = Path.joinpath(Path(dir.name), 'expected.txt')
+        actual = Path.joinpath(Path(dir.name), 'actual.txt')
+        f = open(expected.absolute(), 'wb')
+        f.write(expected_text)
+        f.close()
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4630')
+        await asyncio.sleep(0.5)
+        sender = await asyncio.create_subprocess_exec('./incp', expected.absolute(), f"[::1]:4630:{actual.absolute()}")
+        await receiver.wait()
+        await sender.wait()
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual(0, sender.returncode)
+        f = open(actual.absolute(), 'rb')
+        actual_text = f.read()
+        f.close()
+        self.assertEqual(expected_text, actual_text)
+
+        dir.cleanup()
+
+    async def test_incp_many_src_files_dest_dir(self):
+        '''
+        It should copy every source file into the destination directory, in
+        order, when there are more source files than are opened ahead of time.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        output_dir = Path.joinpath(Path(dir.name), 'output_dir')
+        os.mkdir(output_dir)
+        sources = []
+        for i in range(25):
+            src = Path.joinpath(Path(dir.name), f'src{i}.txt')
+            f = open(src.absolute(), 'wb')
+            f.write(f'file {i}\n'.encode() * (i * 100))
+            f.close()
+            sources.append(src.absolute())
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4631', stdout=asyncio.subprocess.PIPE)
+        await asyncio.sleep(0.5)
+        sender = await asyncio.create_subprocess_exec('./incp', *sources, f"127.0.0.1:4631:{output_dir.absolute()}")
+        stdout, _ = await receiver.communicate()
+        await sender.wait()
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual(0, sender.returncode)
+        written = [Path(line).name for line in stdout.decode().splitlines()]
+        self.assertEqual([src.name for src in sources], written)
+        for src in sources:
+            f = open(src, 'rb')
+            expected_text = f.read()
+            f.close()
+            f = open(Path.joinpath(output_dir, src.name), 'rb')
+            actual_text = f.read()
+            f.close()
+            self.assertEqual(expected_text, actual_text)
+
+        dir.cleanup()
+
+    async def test_incp_sync_policies(self):
+        '''
+        It should write every file into place, without leaving temporary files
+        behind, under each sync policy.
+        '''
+        for port, policy in (('4632', 'none'), ('4633', 'batch'), ('4634', 'file')):
+            with self.subTest(policy=policy):
+                dir = tempfile.TemporaryDirectory()
+                output_dir = Path.joinpath(Path(dir.name), 'output_dir')
+                os.mkdir(output_dir)
+                sources = []
+                for i in range(3):
+                    src = Path.joinpath(Path(dir.name), f'src{i}.txt')
+                    f = open(src.absolute(), 'wb')
+                    f.write(f'{policy} {i}\n'.encode())
+                    f.close()
+                    sources.append(src.absolute())
+
+                receiver = await asyncio.create_subprocess_exec('./incp', '-l', f'--sync={policy}', port)
+                await asyncio.sleep(0.5)
+                sender = await asyncio.create_subprocess_exec('./incp', *sources, f"127.0.0.1:{port}:{output_dir.absolute()}")
+                await receiver.wait()
+                await sender.wait()
+
+                self.assertEqual(0, receiver.returncode)
+                self.assertEqual(0, sender.returncode)
+                self.assertEqual(sorted(src.name for src in sources), sorted(os.listdir(output_dir)))
+                for i, src in enumerate(sources):
+                    f = open(Path.joinpath(output_dir, src.name), 'rb')
+                    actual_text = f.read()
+                    f.close()
+                    self.assertEqual(f'{policy} {i}\n'.encode(), actual_text)
+
+                dir.cleanup()
+
+    async def test_incp_dest_file_keeps_identity(self):
+        '''
+        It should keep the hard links and the owner of an existing destination
+        file.
+        '''
+        if os.name != 'posix':
+            self.skipTest('hard links and owners are POSIX only')
+        dir = tempfile.TemporaryDirectory()
+        src = Path.joinpath(Path(dir.name), 'src.txt')
+        f = open(src.absolute(), 'wb')
+        f.write(b'new contents\n')
+        f.close()
+        linked = Path.joinpath(Path(dir.name), 'linked.txt')
+        f = open(linked.absolute(), 'wb')
+        f.write(b'old contents\n')
+        f.close()
+        os.link(linked.absolute(), Path.joinpath(Path(dir.name), 'link.txt').absolute())
+        owned = Path.joinpath(Path(dir.name), 'owned.txt')
+        f = open(owned.absolute(), 'wb')
+        f.write(b'old contents\n')
+        f.close()
+        if os.geteuid() == 0:
+            os.chown(owned.absolute(), 65534, 65534)
+        linked_info = os.stat(linked.absolute())
+        owned_info = os.stat(owned.absolute())
+
+        for port, dest in (('4641', linked), ('4642', owned)):
+            receiver = await asyncio.create_subprocess_exec('./incp', '-l', port, stdout=asyncio.subprocess.DEVNULL)
+            await asyncio.sleep(0.5)
+            sender = await asyncio.create_subprocess_exec('./incp', '--no-local', src.absolute(), f"127.0.0.1:{port}:{dest.absolute()}")
+            await receiver.wait()
+            await sender.wait()
+            self.assertEqual(0, receiver.returncode)
+            self.assertEqual(0, sender.returncode)
+            f = open(dest.absolute(), 'rb')
+            self.assertEqual(b'new contents\n', f.read())
+            f.close()
+
+        self.assertEqual(linked_info.st_ino, os.stat(linked.absolute()).st_ino)
+        self.assertEqual(2, os.stat(linked.absolute()).st_nlink)
+        self.assertEqual((owned_info.st_uid, owned_info.st_gid), (os.stat(owned.absolute()).st_uid, os.stat(owned.absolute()).st_gid))
+
+        dir.cleanup()
+
+    async def test_incp_dest_file_keeps_xattrs(self):
+        '''
+        It should replace an existing destination file by renaming a new file
+        over it, unless that would lose its extended attributes.
+        '''
+        if not sys.platform.startswith('linux'):
+            self.skipTest('extended attributes are only checked on Linux')
+        dir = tempfile.TemporaryDirectory()
+        src = Path.joinpath(Path(dir.name), 'src.txt')
+        f = open(src.absolute(), 'wb')
+        f.write(b'new contents\n')
+        f.close()
+        plain = Path.joinpath(Path(dir.name), 'plain.txt')
+        tagged = Path.joinpath(Path(dir.name), 'tagged.txt')
+        for dest in (plain, tagged):
+            f = open(dest.absolute(), 'wb')
+            f.write(b'old contents\n')
+            f.close()
+        try:
+            os.setxattr(tagged.absolute(), 'user.incp', b'tag')
+        except OSError:
+            self.skipTest('extended attributes are not supported')
+        plain_info = os.stat(plain.absolute())
+        tagged_info = os.stat(tagged.absolute())
+
+        for port, dest in (('4650', plain), ('4651', tagged)):
+            receiver = await asyncio.create_subprocess_exec('./incp', '-l', port, stdout=asyncio.subprocess.DEVNULL)
+            await asyncio.sleep(0.5)
+            sender = await asyncio.create_subprocess_exec('./incp', '--no-local', src.absolute(), f"127.0.0.1:{port}:{dest.absolute()}")
+            await receiver.wait()
+            await sender.wait()
+            self.assertEqual(0, receiver.returncode)
+            self.assertEqual(0, sender.returncode)
+            f = open(dest.absolute(), 'rb')
+            self.assertEqual(b'new contents\n', f.read())
+            f.close()
+
+        self.assertNotEqual(plain_info.st_ino, os.stat(plain.absolute()).st_ino)
+        self.assertEqual(tagged_info.st_ino, os.stat(tagged.absolute()).st_ino)
+        self.assertEqual(b'tag', os.getxattr(tagged.absolute(), 'user.incp'))
+
+        dir.cleanup()
+
+    async def test_incp_sync_batch_idle_client(self):
+        '''
+        It should commit a batch of files while the client is quiet, before the
+        connection ends.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '--sync=batch', '4645', stdout=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        reader, writer = await asyncio.open_connection('127.0.0.1', 4645)
+        self.assertEqual(b'HELLO\r\n', await reader.readline())
+        writer.write(f'---------- 0 {dir.name}\r\n'.encode())
+        self.assertEqual(b'OK\r\n', await reader.readline())
+        writer.write(b'-rw-r--r-- 5 idle.txt\r\n')
+        self.assertEqual(b'OK\r\n', await reader.readline())
+        writer.write(b'idle\n')
+        self.assertEqual(b'OK\r\n', await reader.readline())
+        await asyncio.sleep(1.5)
+
+        self.assertEqual(['idle.txt'], os.listdir(dir.name))
+
+        writer.write_eof()
+        self.assertEqual(b'OK\r\n', await reader.readline())
+        writer.close()
+        await receiver.wait()
+        self.assertEqual(0, receiver.returncode)
+
+        dir.cleanup()
+
+    async def test_incp_sync_batch_rename_fails(self):
+        '''
+        It should reply ERROR in place of the final OK when a file cannot be
+        committed, and still commit the other files.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '--sync=batch', '4646', stdout=asyncio.subprocess.DEVNULL, stderr=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        reader, writer = await asyncio.open_connection('127.0.0.1', 4646)
+        self.assertEqual(b'HELLO\r\n', await reader.readline())
+        writer.write(f'---------- COMMIT? {dir.name}\r\n'.encode())
+        self.assertEqual(b'OK COMMIT\r\n', await reader.readline())
+        for name in ['x.txt', 'y.txt']:
+            writer.write(f'-rw-r--r-- 5 {name}\r\n'.encode())
+            self.assertEqual(b'OK\r\n', await reader.readline())
+            writer.write(name[0].encode() * 4 + b'\n')
+            self.assertEqual(b'OK\r\n', await reader.readline())
+        # A directory in the way makes the rename of x.txt fail.
+        os.mkdir(Path.joinpath(Path(dir.name), 'x.txt'))
+
+        writer.write_eof()
+        self.assertTrue((await reader.readline()).startswith(b'ERROR '))
+        writer.close()
+        await receiver.wait()
+
+        self.assertEqual(1, receiver.returncode)
+        self.assertEqual(['x.txt', 'y.txt'], sorted(os.listdir(dir.name)))
+        self.assertTrue(Path.joinpath(Path(dir.name), 'x.txt').is_dir())
+        f = open(Path.joinpath(Path(dir.name), 'y.txt').absolute(), 'rb')
+        self.assertEqual(b'yyyy\n', f.read())
+        f.close()
+
+        dir.cleanup()
+
+    async def test_incp_server_without_final_ok(self):
+        '''
+        It should fail when a server that offered a final OK closes the
+        connection without one, but not when an older server does.
+        '''
+        for port, reply, expected in [(4647, b'OK COMMIT\r\n', 1), (4648, b'OK\r\n', 0)]:
+            with self.subTest(reply=reply):
+                async def serve(reader, writer):
+                    writer.write(b'HELLO\r\n')
+                    self.assertIn(b'COMMIT', await reader.readline())
+                    writer.write(reply)
+                    info = await reader.readline()
+                    writer.write(b'OK\r\n')
+                    await reader.readexactly(int(info.split(b' ')[1]))
+                    writer.write(b'OK\r\n')
+                    await reader.read()
+                    writer.close()
+
+                dir = tempfile.TemporaryDirectory()
+                src = Path.joinpath(Path(dir.name), 'src.txt')
+                f = open(src.absolute(), 'wb')
+                f.write(b'src\n')
+                f.close()
+                server = await asyncio.start_server(serve, '127.0.0.1', port)
+                sender = await asyncio.create_subprocess_exec('./incp', '--no-local', src.absolute(), f'127.0.0.1:{port}:dest.txt', stderr=asyncio.subprocess.DEVNULL)
+                await sender.wait()
+                server.close()
+                await server.wait_closed()
+
+                self.assertEqual(expected, sender.returncode)
+
+                dir.cleanup()
+
+    async def test_incp_long_file_name(self):
+        '''
+        It should copy a file whose name is as long as the file system allows.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        name = 'n' * 251 + '.txt'
+        src = Path.joinpath(Path(dir.name), name)
+        f = open(src.absolute(), 'wb')
+        f.write(b'long\n')
+        f.close()
+        dest = Path.joinpath(Path(dir.name), 'dest')
+        os.mkdir(dest.absolute())
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4649', stdout=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        sender = await asyncio.create_subprocess_exec('./incp', '--no-local', src.absolute(), f'127.0.0.1:4649:{dest.absolute()}')
+        await receiver.wait()
+        await sender.wait()
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual(0, sender.returncode)
+        self.assertEqual([name], os.listdir(dest.absolute()))
+
+        dir.cleanup()
+
+    async def test_incp_sync_policy_invalid(self):
+        '''
+        It should print usage and fail when given an unknown sync policy.
+        '''
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '--sync=sometimes', stdout=asyncio.subprocess.DEVNULL)
+        await receiver.wait()
+
+        self.assertEqual(1, receiver.returncode)
+
+    async def test_incp_same_host_copy(self):
+        '''
+        It should copy a large file intact whether the receiver copies it
+        locally or it is sent over the connection. Only a client that runs as
+        the same user as the receiver, or as root, may have it copied locally.
+        '''
+        cases = [('4635', [], None), ('4636', ['--no-local'], None)]
+        if os.name == 'posix' and os.geteuid() == 0:
+            cases.append(('4643', [], 65534))
+        for port, args, user in cases:
+            with self.subTest(args=args, user=user):
+                expected_text = os.urandom(3 * 1024 * 1024 + 17)
+                dir = tempfile.TemporaryDirectory()
+                expected = Path.joinpath(Path(dir.name), 'expected.bin')
+                actual = Path.joinpath(Path(dir.name), 'actual.bin')
+                f = open(expected.absolute(), 'wb')
+                f.write(expected_text)
+                f.close()
+                os.chmod(expected.absolute(), stat.S_IREAD | stat.S_IWRITE | stat.S_IEXEC | stat.S_IRGRP | stat.S_IROTH)
+                trace = Path.joinpath(Path(dir.name), 'trace.json')
+                program = os.path.abspath('incp')
+                if user is not None:
+                    # The other user may not be able to reach this directory.
+                    os.chmod(dir.name, 0o755)
+                    program = shutil.copy(program, dir.name)
+
+                receiver = await asyncio.create_subprocess_exec('./incp', '-l', f'--trace={trace.absolute()}', port)
+                await asyncio.sleep(0.5)
+                sender = await asyncio.create_subprocess_exec(program, *args, expected.absolute(), f"127.0.0.1:{port}:{actual.absolute()}", user=user)
+                await receiver.wait()
+                await sender.wait()
+
+                self.assertEqual(0, receiver.returncode)
+                self.assertEqual(0, sender.returncode)
+                f = open(trace.absolute(), 'r')
+                spans = {e['name'] for e in json.load(f)['traceEvents']}
+                f.close()
+                pulled = sys.platform.startswith('linux') and args == [] and user is None
+                self.assertEqual(pulled, 'local_copy' in spans)
+                f = open(actual.absolute(), 'rb')
+                actual_text = f.read()
+                f.close()
+                self.assertEqual(expected_text, actual_text)
+                expected_info = os.stat(expected.absolute())
+                actual_info = os.stat(actual.absolute())
+                self.assertEqual(expected_info.st_mode, actual_info.st_mode)
+
+                dir.cleanup()
+
+    async def test_libincp_session_reuses_connection(self):
+        '''
+        It should run several transfers with different destinations over one
+        library session and report each one through the poll handle.
+        '''
+        if os.name != 'posix' or not Path('./libincp.so').exists():
+            self.skipTest('libincp.so is not built')
+        try:
+            lib = ctypes.CDLL('./libincp.so')
+        except OSError as e:
+            # Sanitizer builds cannot be loaded into an uninstrumented process.
+            self.skipTest(f'libincp.so cannot be loaded: {e}')
+        callback_type = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_ulong, ctypes.c_int, ctypes.c_char_p, ctypes.c_void_p)
+        lib.incp_session_open.restype = ctypes.c_void_p
+        lib.incp_session_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+        lib.incp_session_submit.restype = ctypes.c_ulong
+        lib.incp_session_submit.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t, ctypes.c_char_p, callback_type, ctypes.c_void_p]
+        lib.incp_session_pollfd.restype = ctypes.c_ssize_t
+        lib.incp_session_pollfd.argtypes = [ctypes.c_void_p]
+        lib.incp_session_poll.restype = ctypes.c_size_t
+        lib.incp_session_poll.argtypes = [ctypes.c_void_p]
+        lib.incp_session_close.argtypes = [ctypes.c_void_p]
+
+        dir = tempfile.TemporaryDirectory()
+        output_dirs = [Path.joinpath(Path(dir.name), f'output_dir{i}') for i in range(2)]
+        sources = []
+        for i, output_dir in enumerate(output_dirs):
+            os.mkdir(output_dir)
+            src = Path.joinpath(Path(dir.name), f'src{i}.txt')
+            f = open(src.absolute(), 'wb')
+            f.write(f'transfer {i}\n'.encode())
+            f.close()
+            sources.append(src)
+
+        finished = []
+        callback = callback_type(lambda session, id, status, message, userdata: finished.append((id, status)))
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4637', stdout=asyncio.subprocess.DEVNULL)
+        self.assertEqual(0, lib.incp_init())
+        session = lib.incp_session_open(b'127.0.0.1', b'4637', 0)
+        self.assertIsNotNone(session)
+        ids = []
+        for src, output_dir in zip(sources, output_dirs):
+            paths = (ctypes.c_char_p * 1)(str(src.absolute()).encode())
+            ids.append(lib.incp_session_submit(session, paths, 1, str(output_dir.absolute()).encode(), callback, None))
+        pollfd = lib.incp_session_pollfd(session)
+        while len(finished) < len(ids):
+            await asyncio.to_thread(select.select, [pollfd], [], [], 10)
+            lib.incp_session_poll(session)
+        self.assertEqual(0, lib.incp_session_close(session))
+        lib.incp_cleanup()
+        await receiver.wait()
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual([(id, 0) for id in ids], finished)
+        for i, (src, output_dir) in enumerate(zip(sources, output_dirs)):
+            f = open(Path.joinpath(output_dir, src.name), 'rb')
+            actual_text = f.read()
+            f.close()
+            self.assertEqual(f'transfer {i}\n'.encode(), actual_text)
+
+        dir.cleanup()
+
+    async def test_incp_files_from_manifest(self):
+        '''
+        It should send every file listed in a manifest to its own destination,
+        using one connection per host.
+        '''
+        for manifest_arg in ('file', '-'):
+            with self.subTest(manifest=manifest_arg):
+                dir = tempfile.TemporaryDirectory()
+                output_dirs = [Path.joinpath(Path(dir.name), f'output dir{i}') for i in range(3)]
+                for output_dir in output_dirs:
+                    os.mkdir(output_dir)
+                entries = [
+                    ('a.txt', '4638', output_dirs[0]),
+                    ('b c.txt', '4638', output_dirs[0]),
+                    ('d.txt', '4639', output_dirs[2]),
+                    ('e.txt', '4638', output_dirs[1]),
+                ]
+                manifest_text = '# source<TAB>destination\n\n'
+                for name, port, output_dir in entries:
+                    src = Path.joinpath(Path(dir.name), name)
+                    f = open(src.absolute(), 'wb')
+                    f.write(f'{name}\n'.encode())
+                    f.close()
+                    manifest_text += f'{src.absolute()}\t127.0.0.1:{port}:{output_dir.absolute()}\n'
+                manifest = Path.joinpath(Path(dir.name), 'manifest.txt')
+                f = open(manifest.absolute(), 'w')
+                f.write(manifest_text)
+                f.close()
+
+                receivers = [await asyncio.create_subprocess_exec('./incp', '-l', port, stdout=asyncio.subprocess.DEVNULL) for port in ('4638', '4639')]
+                await asyncio.sleep(0.5)
+                if manifest_arg == '-':
+                    sender = await asyncio.create_subprocess_exec('./incp', '--files-from=-', stdin=asyncio.subprocess.PIPE)
+                    await sender.communicate(manifest_text.encode())
+                else:
+                    sender = await asyncio.create_subprocess_exec('./incp', f'--files-from={manifest.absolute()}')
+                    await sender.wait()
+                for receiver in receivers:
+                    await receiver.wait()
+
+                self.assertEqual(0, sender.returncode)
+                for receiver in receivers:
+                    self.assertEqual(0, receiver.returncode)
+                for name, port, output_dir in entries:
+                    f = open(Path.joinpath(output_dir, name), 'rb')
+                    actual_text = f.read()
+                    f.close()
+                    self.assertEqual(f'{name}\n'.encode(), actual_text)
+
+                dir.cleanup()
+
+    async def test_incp_files_from_receiver_fails(self):
+        '''
+        It should fail the remaining files right away instead of retrying the
+        connection when the receiver exits after an error.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        manifest = Path.joinpath(Path(dir.name), 'manifest.txt')
+        src = Path.joinpath(Path(dir.name), 'src.txt')
+        f = open(src.absolute(), 'wb')
+        f.write(b'src\n')
+        f.close()
+        dests = ['a.txt', 'does_not_exist/b.txt', 'c.txt', 'd.txt']
+        f = open(manifest.absolute(), 'w')
+        for dest in dests:
+            f.write(f'{src.absolute()}\t127.0.0.1:4644:{Path.joinpath(Path(dir.name), dest).absolute()}\n')
+        f.close()
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4644', stdout=asyncio.subprocess.DEVNULL, stderr=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        start = time.monotonic()
+        sender = await asyncio.create_subprocess_exec('./incp', '--no-local', f'--files-from={manifest.absolute()}', stderr=asyncio.subprocess.DEVNULL)
+        await sender.wait()
+        elapsed = time.monotonic() - start
+        await receiver.wait()
+
+        self.assertEqual(1, sender.returncode)
+        self.assertLess(elapsed, 10)
+        self.assertTrue(Path.joinpath(Path(dir.name), 'a.txt').exists())
+
+        dir.cleanup()
+
+    async def test_incp_files_from_bad_line(self):
+        '''
+        It should fail when a manifest line has no destination.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        manifest = Path.joinpath(Path(dir.name), 'manifest.txt')
+        f = open(manifest.absolute(), 'w')
+        f.write('no_destination.txt\n')
+        f.close()
+
+        sender = await asyncio.create_subprocess_exec('./incp', f'--files-from={manifest.absolute()}', stderr=asyncio.subprocess.DEVNULL)
+        await sender.wait()
+
+        self.assertEqual(1, sender.returncode)
+
+        dir.cleanup()
+
+    async def test_incp_trace(self):
+        '''
+        It should write a Chrome trace event file on both sides that covers the
+        handshake, every file, and the data sent and received. Long details
+        keep their end.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        src = Path.joinpath(Path(dir.name), '\u00fc' * 40 + 's.txt')
+        f = open(src.absolute(), 'wb')
+        f.write(b'traced\n' * 10000)
+        f.close()
+        output_dir = Path.joinpath(Path(dir.name), 'output_dir')
+        os.mkdir(output_dir)
+        receiver_trace = Path.joinpath(Path(dir.name), 'receiver.json')
+        sender_trace = Path.joinpath(Path(dir.name), 'sender.json')
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', f'--trace={receiver_trace.absolute()}', '4640', stdout=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        sender = await asyncio.create_subprocess_exec('./incp', '--no-local', f'--trace={sender_trace.absolute()}', src.absolute(), f"127.0.0.1:4640:{output_dir.absolute()}")
+        await receiver.wait()
+        await sender.wait()
+
+        self.assertEqual(0, receiver.returncode)
+        self.assertEqual(0, sender.returncode)
+        expected = (
+            (receiver_trace, {'accept', 'hello', 'dest', 'open', 'recv', 'write', 'cpyperm', 'file'}, Path.joinpath(output_dir, src.name)),
+            (sender_trace, {'connect', 'hello', 'dest', 'stat', 'open', 'send', 'wait_ok', 'file'}, src),
+        )
+        for trace, names, path in expected:
+            f = open(trace.absolute(), 'r')
+            events = json.load(f)['traceEvents']
+            f.close()
+            spans = [e for e in events if e['ph'] == 'X']
+            self.assertTrue(names <= {e['name'] for e in spans})
+            for e in spans:
+                self.assertGreaterEqual(e['ts'], 0)
+                self.assertGreaterEqual(e['dur'], 0)
+            files = [e['args']['detail'] for e in spans if e['name'] == 'file']
+            detail = str(path.absolute()).encode()[-60:]
+            while detail[0] & 0xC0 == 0x80:
+                detail = detail[1:]
+            self.assertEqual(['...' + detail.decode()], files)
+
+        dir.cleanup()
+
+    async def test_incp_trace_failed_open(self):
+        '''
+        It should record a span with the error for a source file that cannot be
+        opened.
+        '''
+        dir = tempfile.TemporaryDirectory()
+        src = Path.joinpath(Path(dir.name), 'does_not_exist.txt')
+        sender_trace = Path.joinpath(Path(dir.name), 'sender.json')
+
+        receiver = await asyncio.create_subprocess_exec('./incp', '-l', '4652', stdout=asyncio.subprocess.DEVNULL)
+        await asyncio.sleep(0.5)
+        sender = await asyncio.create_subprocess_exec('./incp', '--no-local', f'--trace={sender_trace.absolute()}', src.absolute(), f"127.0.0.1:4652:{dir.name}", stderr=asyncio.subprocess.DEVNULL)
+        await receiver.wait()
+        await sender.wait()
+
+        self.assertEqual(1, sender.returncode)
+        f = open(sender_trace.absolute(), 'r')
+        events = json.load(f)['traceEvents']
+        f.close()
+        opens = [e['args']['detail'] for e in events if e['ph'] == 'X' and e['name'] == 'open']
+        self.assertEqual(1, len(opens))
+        self.assertTrue(opens[0].endswith(f'does_not_exist.txt: {os.strerror(errno.ENOENT)}'))
+
+        dir.cleanup()
+
     async def test_incp_src_file_dest_file_cannot_open(self):
         '''
         POSIX 3.c